@@ -0,0 +1,99 @@
+#include <crails-builtin-assets/perfect_hash.hpp>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+// Compares the two ways a class generated by crails-builtin-assets can
+// serve its assets:
+// - registering each asset at construction, in a map indexed by the asset
+//   path, which then gets looked up for each request. This reproduces what
+//   BuiltinAssets::add does, without depending on libcrails;
+// - the generated perfect hash table, which needs no construction, and
+//   probes a single slot per lookup.
+
+struct Asset
+{
+  std::string_view path;
+  const void*      data;
+  unsigned int     length;
+};
+
+typedef std::chrono::steady_clock Clock;
+
+static double elapsed_ns(Clock::time_point start, std::size_t operations)
+{
+  return std::chrono::duration<double, std::nano>(Clock::now() - start).count() / operations;
+}
+
+static std::vector<std::string> make_paths(std::size_t count)
+{
+  static const char* directories[] = {"images/", "javascripts/", "stylesheets/", "fonts/", "images/icons/"};
+  static const char* extensions[] = {".png", ".js", ".css", ".woff2", ".svg"};
+  std::vector<std::string> paths;
+
+  for (std::size_t i = 0 ; i < count ; ++i)
+    paths.push_back(std::string(directories[i % 5]) + "asset-" + std::to_string(i * 7919 % 100003) + extensions[i % 5]);
+  return paths;
+}
+
+static void run(std::size_t asset_count, std::size_t lookup_count)
+{
+  std::vector<std::string> paths = make_paths(asset_count);
+  std::vector<std::string> requests;
+  std::string data(64, 'x');
+  std::size_t found = 0;
+  PerfectHash hash;
+  std::vector<Asset> table;
+  Clock::time_point start;
+  double map_construction, map_lookup, table_lookup, table_generation;
+
+  // Requests hit known assets 9 times out of 10
+  for (std::size_t i = 0 ; i < lookup_count ; ++i)
+    requests.push_back(i % 10 == 9 ? "missing/asset-" + std::to_string(i) + ".png" : paths[i * 31 % asset_count]);
+
+  start = Clock::now();
+  {
+    std::map<std::string, std::pair<const char*, std::size_t>> files;
+
+    for (const std::string& path : paths)
+      files.emplace(path, std::pair<const char*, std::size_t>(data.data(), data.length()));
+    map_construction = elapsed_ns(start, 1);
+    start = Clock::now();
+    for (const std::string& request : requests)
+      found += files.find(request) != files.end();
+    map_lookup = elapsed_ns(start, lookup_count);
+  }
+
+  start = Clock::now();
+  hash.build(paths);
+  table_generation = elapsed_ns(start, 1);
+  for (std::size_t key : hash.slots)
+    table.push_back(Asset{paths[key], data.data(), static_cast<unsigned int>(data.length())});
+  start = Clock::now();
+  for (const std::string& request : requests)
+  {
+    const Asset& asset = table[hash.slot_for(request)];
+
+    found += asset.path == request;
+  }
+  table_lookup = elapsed_ns(start, lookup_count);
+
+  std::cout << std::setw(8) << asset_count
+            << std::setw(16) << std::fixed << std::setprecision(1) << map_construction / 1000
+            << std::setw(14) << map_lookup
+            << std::setw(18) << table_generation / 1000
+            << std::setw(14) << table_lookup
+            << "   (" << found << " hits)" << std::endl;
+}
+
+int main()
+{
+  std::cout << "  assets  map build (us)  map find (ns)  table build (us)  table find (ns)" << std::endl;
+  std::cout << "                                         (generator only)" << std::endl;
+  for (std::size_t asset_count : {16, 256, 4096, 65536})
+    run(asset_count, 1000000);
+  return 0;
+}
@@ -0,0 +1,439 @@
+#include <crails-assets/file_mapper.hpp>
+#include <crails-assets/build_cache.hpp>
+#include <crails-assets/compression_policy.hpp>
+#include <crails-assets/image_optimizer.hpp>
+#include <crails-assets/exclusion_pattern.hpp>
+#include <crails-assets/glob_pattern.hpp>
+#include <crails-assets/manifest.hpp>
+#include <crails-assets-common/digest.hpp>
+#include <crails/cli/filesystem.hpp>
+#include <boost/program_options.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <filesystem>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <random>
+#include <sstream>
+#include <thread>
+#include <cstdlib>
+
+// Times each phase of crails-assets, in isolation, on a synthetic asset tree.
+// Trees are generated from a seed, so that runs on different versions of
+// crails-assets measure the same inputs (as long as they are built with the
+// same standard library). Results are written as JSON:
+//
+//   ./crails-assets-phases --files 5000 --runs 5 --json results.json
+
+bool update_reference_files(const FileMapper& file_map, std::string_view output_path, std::string_view public_directory, const ExclusionPattern&);
+bool generate_reference_files(const FileMapper& file_map, std::string_view output_path, std::string_view public_directory, const ExclusionPattern&);
+bool generate_public_folder(FileMapper& filemap, const std::string& output_directory, CompressionPolicy& compression, ImageOptimizer& images, BuildCache& cache, AssetManifest& manifest, bool verbose);
+std::string sass_implementation();
+std::string minify_implementation();
+
+// Options otherwise defined by crails-assets.cpp
+bool verbose_mode = false;
+bool with_source_maps = false;
+DigestAlgorithm digest_algorithm = Md5Digest;
+unsigned short checksum_length = 0;
+unsigned int job_count = std::thread::hardware_concurrency();
+bool split_register = false;
+
+typedef std::chrono::steady_clock Clock;
+
+struct TreeOptions
+{
+  unsigned int   file_count = 2000;
+  unsigned int   depth = 3;
+  unsigned int   branching = 4;
+  std::uintmax_t min_size = 256;
+  std::uintmax_t max_size = 256 * 1024;
+  double         references = 1.0; // average asset_path() calls per stylesheet or script
+  double         map_ratio = 0.2;  // ratio of scripts coming with a sourcemap
+  std::map<std::string, unsigned int> mix{{".scss", 1}, {".css", 2}, {".js", 3}, {".png", 4}};
+  unsigned int   seed = 42;
+};
+
+struct TreeStatistics
+{
+  std::map<std::string, unsigned int> files;
+  std::uintmax_t bytes = 0;
+  unsigned int   references = 0;
+};
+
+static const char* words[] = {
+  "asset", "render", "layout", "button", "header", "footer", "widget", "submit", "primary", "color",
+  "margin", "padding", "display", "border", "content", "request", "response", "session", "value", "index"
+};
+
+class TreeGenerator
+{
+public:
+  TreeGenerator(const TreeOptions& options) : options(options), random(options.seed)
+  {
+  }
+
+  bool generate(const std::filesystem::path& root, TreeStatistics& statistics)
+  {
+    std::vector<std::pair<std::string, std::string>> files;
+
+    // Paths are picked first, so that stylesheets and scripts can reference any image
+    for (unsigned int i = 0 ; i < options.file_count ; ++i)
+    {
+      std::string extension = pick_extension();
+
+      files.emplace_back(pick_directory() + "asset" + std::to_string(i) + extension, extension);
+      if (extension == ".png")
+        images.push_back(files.back().first);
+    }
+    for (const auto& file : files)
+    {
+      std::filesystem::path path = root / file.first;
+      std::string contents = make_contents(file.second, pick_size(), statistics);
+
+      std::filesystem::create_directories(path.parent_path());
+      if (!Crails::write_file("crails-assets-phases", path.string(), contents))
+        return false;
+      statistics.files[file.second]++;
+      statistics.bytes += contents.length();
+      if (file.second == ".js" && std::bernoulli_distribution(options.map_ratio)(random))
+      {
+        contents = "{\"version\":3,\"file\":\"" + path.filename().string() + "\",\"sources\":[],\"mappings\":\"\"}";
+        if (!Crails::write_file("crails-assets-phases", path.string() + ".map", contents))
+          return false;
+        statistics.files[".map"]++;
+        statistics.bytes += contents.length();
+      }
+    }
+    return true;
+  }
+
+private:
+  std::string pick_extension()
+  {
+    unsigned int total = 0, value;
+
+    for (const auto& entry : options.mix)
+      total += entry.second;
+    value = std::uniform_int_distribution<unsigned int>(0, std::max(1u, total) - 1)(random);
+    for (const auto& entry : options.mix)
+    {
+      if (value < entry.second)
+        return entry.first;
+      value -= entry.second;
+    }
+    return ".css";
+  }
+
+  std::string pick_directory()
+  {
+    std::string directory;
+    unsigned int depth = std::uniform_int_distribution<unsigned int>(0, options.depth)(random);
+
+    for (unsigned int i = 0 ; i < depth ; ++i)
+      directory += "dir" + std::to_string(std::uniform_int_distribution<unsigned int>(0, options.branching - 1)(random)) + '/';
+    return directory;
+  }
+
+  // Log-uniform sizes: many small files, a few large ones
+  std::uintmax_t pick_size()
+  {
+    double low = std::log(static_cast<double>(std::max<std::uintmax_t>(1, options.min_size)));
+    double high = std::log(static_cast<double>(std::max(options.min_size, options.max_size)));
+
+    return static_cast<std::uintmax_t>(std::exp(std::uniform_real_distribution<double>(low, high)(random)));
+  }
+
+  unsigned int pick_reference_count()
+  {
+    double whole = std::floor(options.references);
+
+    return static_cast<unsigned int>(whole) + (std::bernoulli_distribution(options.references - whole)(random) ? 1 : 0);
+  }
+
+  std::string make_contents(const std::string& extension, std::uintmax_t size, TreeStatistics& statistics)
+  {
+    std::string contents;
+    unsigned int reference_count = images.size() > 0 ? pick_reference_count() : 0;
+    std::uniform_int_distribution<std::size_t> word(0, sizeof(words) / sizeof(*words) - 1);
+
+    if (extension == ".png")
+    {
+      std::uniform_int_distribution<int> byte(0, 255);
+
+      contents = "\x89PNG\r\n\x1a\n";
+      while (contents.length() < size)
+        contents += static_cast<char>(byte(random));
+      return contents;
+    }
+    for (unsigned int i = 0 ; i < reference_count ; ++i)
+    {
+      const std::string& image = images[std::uniform_int_distribution<std::size_t>(0, images.size() - 1)(random)];
+
+      if (extension == ".js")
+        contents += "var image" + std::to_string(i) + " = asset_path(\"" + image + "\");\n";
+      else
+        contents += ".image" + std::to_string(i) + " { background: url(asset_path(\"" + image + "\")); }\n";
+      statistics.references++;
+    }
+    while (contents.length() < size)
+    {
+      std::string name = std::string(words[word(random)]) + '_' + words[word(random)];
+
+      if (extension == ".js")
+        contents += "function " + name + "(" + words[word(random)] + ") { return " + words[word(random)] + " + " + std::to_string(contents.length()) + "; }\n";
+      else if (extension == ".scss")
+        contents += "$" + name + ": " + std::to_string(contents.length() % 64) + "px;\n." + name + " { margin: $" + name + "; ." + words[word(random)] + " { padding: 0; } }\n";
+      else
+        contents += "." + name + " { " + words[word(random)] + ": " + std::to_string(contents.length() % 64) + "px; }\n";
+    }
+    return contents;
+  }
+
+  const TreeOptions& options;
+  std::mt19937       random;
+  std::vector<std::string> images;
+};
+
+struct Phase
+{
+  std::string         name;
+  std::vector<double> durations; // milliseconds
+  bool                success = true;
+};
+
+class PhaseTimer
+{
+public:
+  double time(const std::string& name, std::function<bool()> callback)
+  {
+    Phase& phase = find_phase(name);
+    Clock::time_point start = Clock::now();
+    bool success = callback();
+    double duration = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+
+    phase.durations.push_back(duration);
+    phase.success = phase.success && success;
+    return duration;
+  }
+
+  void record(const std::string& name, double duration)
+  {
+    find_phase(name).durations.push_back(duration);
+  }
+
+  bool success() const
+  {
+    return std::all_of(phases.begin(), phases.end(), [](const Phase& phase) { return phase.success; });
+  }
+
+  void write_json(std::ostream& stream) const
+  {
+    stream << "  \"phases\": {";
+    for (std::size_t i = 0 ; i < phases.size() ; ++i)
+    {
+      std::vector<double> sorted = phases[i].durations;
+
+      std::sort(sorted.begin(), sorted.end());
+      stream << (i > 0 ? "," : "") << "\n    \"" << phases[i].name << "\": {"
+             << "\"success\": " << (phases[i].success ? "true" : "false")
+             << ", \"min_ms\": " << sorted.front()
+             << ", \"median_ms\": " << sorted[sorted.size() / 2]
+             << ", \"max_ms\": " << sorted.back()
+             << ", \"runs_ms\": [";
+      for (std::size_t j = 0 ; j < phases[i].durations.size() ; ++j)
+        stream << (j > 0 ? ", " : "") << phases[i].durations[j];
+      stream << "]}";
+    }
+    stream << "\n  }\n";
+  }
+
+private:
+  Phase& find_phase(const std::string& name)
+  {
+    auto it = std::find_if(phases.begin(), phases.end(), [&name](const Phase& phase) { return phase.name == name; });
+
+    if (it != phases.end())
+      return *it;
+    phases.push_back(Phase{name, {}});
+    return phases.back();
+  }
+
+  std::vector<Phase> phases;
+};
+
+static void run(const std::filesystem::path& input, const std::filesystem::path& workspace, CompressionStrategy compression, PhaseTimer& timer)
+{
+  std::string plain_output = (workspace / "public-plain").string();
+  std::string output = (workspace / "public").string();
+  std::string autogen = (workspace / "autogen").string();
+  FileMapper files, plain_files;
+  BuildCache cache(output + "/.crails-assets.cache", std::to_string(digest_algorithm), "benchmark");
+  BuildCache plain_cache(plain_output + "/.crails-assets.cache", std::to_string(digest_algorithm), "benchmark");
+  AssetManifest manifest;
+  CompressionPolicy no_compression(NoCompression), compression_policy(compression);
+  ImageOptimizer images; // disabled: it depends on the tools installed
+  ExclusionPattern exclusion_pattern;
+  PathFilter filter;
+  double transforms, generation;
+
+  std::filesystem::remove_all(workspace);
+  std::filesystem::create_directories(autogen);
+  timer.time("collect_files", [&]() { return files.collect_files(input, "", filter); });
+  timer.time("generate_checksums", [&]() { return files.generate_checksums(cache); });
+  timer.time("generate_fingerprints", [&]() { files.generate_fingerprints(); return true; });
+  plain_files = files;
+  transforms = timer.time("public_folder_transforms", [&]() { return generate_public_folder(plain_files, plain_output, no_compression, images, plain_cache, manifest, false); });
+  generation = timer.time("public_folder", [&]() { return generate_public_folder(files, output, compression_policy, images, cache, manifest, false); });
+  timer.record("compression", std::max(0.0, generation - transforms));
+  timer.time("public_folder_unchanged", [&]() { return generate_public_folder(files, output, compression_policy, images, cache, manifest, false); });
+  timer.time("save_build_cache", [&]() { return cache.save(); });
+  timer.time("generate_reference_files", [&]() { return generate_reference_files(files, autogen, output, exclusion_pattern); });
+  timer.time("update_reference_files", [&]() { return update_reference_files(files, autogen, output, exclusion_pattern); });
+}
+
+static bool parse_mix(const std::string& source, std::map<std::string, unsigned int>& mix)
+{
+  std::stringstream stream(source);
+  std::string item;
+
+  mix.clear();
+  while (std::getline(stream, item, ','))
+  {
+    std::size_t separator = item.find(':');
+    std::size_t length;
+
+    if (separator == std::string::npos)
+      return false;
+    try
+    {
+      mix['.' + item.substr(0, separator)] = std::stoul(item.substr(separator + 1), &length);
+    }
+    catch (const std::exception&)
+    {
+      return false;
+    }
+    if (length != item.length() - separator - 1)
+      return false;
+  }
+  return mix.size() > 0;
+}
+
+int main(int argc, char** argv)
+{
+  boost::program_options::options_description desc("Options");
+  boost::program_options::variables_map options;
+  TreeOptions tree;
+  TreeStatistics statistics;
+  PhaseTimer timer;
+  unsigned int runs = 3;
+  std::filesystem::path directory;
+  std::stringstream results;
+  std::streambuf* output_buffer = std::cout.rdbuf();
+  std::ostringstream silenced;
+  CompressionStrategy compression = AllCompressions;
+  std::error_code error;
+
+  desc.add_options()
+    ("files",      boost::program_options::value<unsigned int>(),   "number of generated assets (defaults to 2000)")
+    ("depth",      boost::program_options::value<unsigned int>(),   "maximum directory depth (defaults to 3)")
+    ("branching",  boost::program_options::value<unsigned int>(),   "directories per level (defaults to 4)")
+    ("min-size",   boost::program_options::value<std::uintmax_t>(), "minimum file size in bytes (defaults to 256)")
+    ("max-size",   boost::program_options::value<std::uintmax_t>(), "maximum file size in bytes (defaults to 262144); sizes are log-uniform")
+    ("references", boost::program_options::value<double>(),         "average asset_path() calls per stylesheet and script (defaults to 1)")
+    ("maps",       boost::program_options::value<double>(),         "ratio of scripts coming with a .map file (defaults to 0.2)")
+    ("mix",        boost::program_options::value<std::string>(),    "weight of each file type (defaults to scss:1,css:2,js:3,png:4)")
+    ("seed",       boost::program_options::value<unsigned int>(),   "random seed of the generated tree (defaults to 42)")
+    ("runs",       boost::program_options::value<unsigned int>(),   "number of runs of each phase (defaults to 3)")
+    ("jobs,j",     boost::program_options::value<unsigned int>(),   "number of parallel jobs (defaults to the number of cores)")
+    ("compression,c", boost::program_options::value<std::string>(), "gzip, brotli or all (defaults to all)")
+    ("directory",  boost::program_options::value<std::string>(),    "where to generate the tree and outputs (defaults to a temporary directory, removed afterwards)")
+    ("json",       boost::program_options::value<std::string>(),    "write the results to this file instead of the standard output")
+    ("verbose,v", "display the output of crails-assets")
+    ("help,h", "display help message");
+  boost::program_options::store(boost::program_options::parse_command_line(argc, argv, desc), options);
+  boost::program_options::notify(options);
+  if (options.count("help"))
+  {
+    std::cout << desc << std::endl;
+    return 0;
+  }
+  if (options.count("files"))      tree.file_count = options["files"].as<unsigned int>();
+  if (options.count("depth"))      tree.depth = options["depth"].as<unsigned int>();
+  if (options.count("branching"))  tree.branching = std::max(1u, options["branching"].as<unsigned int>());
+  if (options.count("min-size"))   tree.min_size = options["min-size"].as<std::uintmax_t>();
+  if (options.count("max-size"))   tree.max_size = options["max-size"].as<std::uintmax_t>();
+  if (options.count("references")) tree.references = options["references"].as<double>();
+  if (options.count("maps"))       tree.map_ratio = options["maps"].as<double>();
+  if (options.count("seed"))       tree.seed = options["seed"].as<unsigned int>();
+  if (options.count("runs"))       runs = std::max(1u, options["runs"].as<unsigned int>());
+  if (options.count("jobs"))       job_count = options["jobs"].as<unsigned int>();
+  if (options.count("compression"))
+    compression = options["compression"].as<std::string>() == "gzip" ? Gzip : (options["compression"].as<std::string>() == "brotli" ? Brotli : AllCompressions);
+  if (options.count("mix") && !parse_mix(options["mix"].as<std::string>(), tree.mix))
+  {
+    std::cerr << "invalid --mix option, expected a list such as scss:1,css:2,js:3,png:4" << std::endl;
+    return -1;
+  }
+  if (tree.mix.count(".scss") && sass_implementation().length() == 0)
+  {
+    std::cerr << "no sass implementation found: generating css instead of scss" << std::endl;
+    tree.mix[".css"] += tree.mix[".scss"];
+    tree.mix.erase(".scss");
+  }
+  if (options.count("directory"))
+    directory = options["directory"].as<std::string>();
+  else
+  {
+    std::string pattern = (std::filesystem::temp_directory_path() / "crails-assets-phases-XXXXXX").string();
+
+    if (!mkdtemp(pattern.data()))
+    {
+      std::cerr << "cannot create a temporary directory" << std::endl;
+      return -1;
+    }
+    directory = pattern;
+  }
+
+  {
+    Clock::time_point start = Clock::now();
+
+    if (!TreeGenerator(tree).generate(directory / "input", statistics))
+      return -1;
+    std::cerr << "generated " << tree.file_count << " assets in "
+              << std::chrono::duration<double, std::milli>(Clock::now() - start).count() << "ms" << std::endl;
+  }
+  // crails-assets reports its progress on the standard output
+  if (!options.count("verbose"))
+    std::cout.rdbuf(silenced.rdbuf());
+  for (unsigned int i = 0 ; i < runs ; ++i)
+  {
+    run(directory / "input", directory / "run", compression, timer);
+    silenced.str("");
+  }
+  std::cout.rdbuf(output_buffer);
+
+  results << std::fixed << std::setprecision(3) << "{\n"
+          << "  \"tree\": {\"files\": " << tree.file_count << ", \"depth\": " << tree.depth
+          << ", \"branching\": " << tree.branching << ", \"seed\": " << tree.seed
+          << ", \"bytes\": " << statistics.bytes << ", \"references\": " << statistics.references << ", \"types\": {";
+  for (auto it = statistics.files.begin() ; it != statistics.files.end() ; ++it)
+    results << (it != statistics.files.begin() ? ", " : "") << '"' << it->first.substr(1) << "\": " << it->second;
+  results << "}},\n"
+          << "  \"jobs\": " << job_count << ",\n"
+          << "  \"runs\": " << runs << ",\n"
+          << "  \"sass\": \"" << sass_implementation() << "\",\n"
+          << "  \"minifier\": \"" << minify_implementation() << "\",\n";
+  timer.write_json(results);
+  results << "}\n";
+  if (options.count("json"))
+    Crails::write_file("crails-assets-phases", options["json"].as<std::string>(), results.str());
+  else
+    std::cout << results.str();
+  if (!options.count("directory"))
+    std::filesystem::remove_all(directory, error);
+  return timer.success() ? 0 : -1;
+}
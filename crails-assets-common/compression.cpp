@@ -0,0 +1,79 @@
+#include "compression.hpp"
+#include <brotli/encode.h>
+#include <zlib.h>
+#include <algorithm>
+#include <cstdint>
+
+std::string compression_extension(CompressionStrategy strategy)
+{
+  switch (strategy)
+  {
+  case Gzip:
+    return ".gz";
+  case Brotli:
+    return ".br";
+  default:
+    break ;
+  }
+  return "";
+}
+
+static bool gzip_compress(std::string_view input, std::string& output, const CompressionLevels& levels)
+{
+  z_stream stream{};
+  int      level = levels.max_effort ? Z_BEST_COMPRESSION : levels.gzip;
+  int      status;
+
+  // windowBits + 16 selects the gzip container
+  if (deflateInit2(&stream, level, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK)
+    return false;
+  if (levels.max_effort)
+    deflateTune(&stream, 258, 258, 258, 32768);
+  output.resize(deflateBound(&stream, input.length()));
+  stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(input.data()));
+  stream.avail_in = input.length();
+  stream.next_out = reinterpret_cast<Bytef*>(output.data());
+  stream.avail_out = output.length();
+  status = deflate(&stream, Z_FINISH);
+  output.resize(stream.total_out);
+  deflateEnd(&stream);
+  return status == Z_STREAM_END;
+}
+
+static bool brotli_compress(std::string_view input, std::string& output, const CompressionLevels& levels)
+{
+  BrotliEncoderState* state = BrotliEncoderCreateInstance(nullptr, nullptr, nullptr);
+  std::size_t available_in = input.length();
+  const std::uint8_t* next_in = reinterpret_cast<const std::uint8_t*>(input.data());
+  std::size_t available_out;
+  std::uint8_t* next_out;
+  bool success;
+
+  if (!state)
+    return false;
+  BrotliEncoderSetParameter(state, BROTLI_PARAM_QUALITY, levels.max_effort ? BROTLI_MAX_QUALITY : levels.brotli);
+  BrotliEncoderSetParameter(state, BROTLI_PARAM_LGWIN, levels.max_effort ? BROTLI_MAX_WINDOW_BITS : BROTLI_DEFAULT_WINDOW);
+  BrotliEncoderSetParameter(state, BROTLI_PARAM_SIZE_HINT, std::min<std::size_t>(input.length(), 1 << 30));
+  output.resize(BrotliEncoderMaxCompressedSize(input.length()) + 1024);
+  available_out = output.length();
+  next_out = reinterpret_cast<std::uint8_t*>(output.data());
+  success = BrotliEncoderCompressStream(state, BROTLI_OPERATION_FINISH, &available_in, &next_in, &available_out, &next_out, nullptr)
+         && BrotliEncoderIsFinished(state);
+  output.resize(output.length() - available_out);
+  BrotliEncoderDestroyInstance(state);
+  return success;
+}
+
+bool compress(CompressionStrategy strategy, std::string_view input, std::string& output, const CompressionLevels& levels)
+{
+  switch (strategy)
+  {
+  case Gzip:
+    return gzip_compress(input, output, levels);
+  case Brotli:
+    return brotli_compress(input, output, levels);
+  default:
+    break ;
+  }
+  return false;
+}
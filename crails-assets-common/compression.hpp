@@ -0,0 +1,22 @@
+#pragma once
+#include <filesystem>
+#include <string>
+#include <string_view>
+
+enum CompressionStrategy
+{
+  Gzip,
+  Brotli,
+  AllCompressions,
+  NoCompression
+};
+
+struct CompressionLevels
+{
+  int  gzip = 6;
+  int  brotli = 11;
+  bool max_effort = false;
+};
+
+std::string compression_extension(CompressionStrategy strategy);
+bool        compress(CompressionStrategy strategy, std::string_view input, std::string& output, const CompressionLevels& levels);
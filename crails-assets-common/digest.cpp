@@ -0,0 +1,174 @@
+#include "digest.hpp"
+#include "mapped_file.hpp"
+#include <openssl/evp.h>
+#include <cstdint>
+#include <cstring>
+
+static const std::uint64_t xxh_prime1 = 0x9E3779B185EBCA87ULL;
+static const std::uint64_t xxh_prime2 = 0xC2B2AE3D27D4EB4FULL;
+static const std::uint64_t xxh_prime3 = 0x165667B19E3779F9ULL;
+static const std::uint64_t xxh_prime4 = 0x85EBCA77C2B2AE63ULL;
+static const std::uint64_t xxh_prime5 = 0x27D4EB2F165667C5ULL;
+
+static std::string to_hex(const unsigned char* bytes, std::size_t length)
+{
+  static const char digits[] = "0123456789abcdef";
+  std::string result;
+
+  result.reserve(length * 2);
+  for (std::size_t i = 0 ; i < length ; ++i)
+  {
+    result += digits[bytes[i] >> 4];
+    result += digits[bytes[i] & 0x0f];
+  }
+  return result;
+}
+
+static std::uint64_t rotl64(std::uint64_t value, int bits)
+{
+  return (value << bits) | (value >> (64 - bits));
+}
+
+static std::uint64_t read64(const unsigned char* p)
+{
+  std::uint64_t value;
+  std::memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+static std::uint32_t read32(const unsigned char* p)
+{
+  std::uint32_t value;
+  std::memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+static std::uint64_t xxh64_round(std::uint64_t accumulator, std::uint64_t input)
+{
+  accumulator += input * xxh_prime2;
+  accumulator = rotl64(accumulator, 31);
+  return accumulator * xxh_prime1;
+}
+
+static std::uint64_t xxh64_merge_round(std::uint64_t accumulator, std::uint64_t value)
+{
+  accumulator ^= xxh64_round(0, value);
+  return accumulator * xxh_prime1 + xxh_prime4;
+}
+
+// XXH64, seed 0 (little-endian hosts)
+static std::uint64_t xxh64(std::string_view data)
+{
+  const unsigned char* p = reinterpret_cast<const unsigned char*>(data.data());
+  const unsigned char* end = p + data.length();
+  std::uint64_t hash;
+
+  if (data.length() >= 32)
+  {
+    const unsigned char* limit = end - 32;
+    std::uint64_t v1 = xxh_prime1 + xxh_prime2;
+    std::uint64_t v2 = xxh_prime2;
+    std::uint64_t v3 = 0;
+    std::uint64_t v4 = 0 - xxh_prime1;
+
+    do
+    {
+      v1 = xxh64_round(v1, read64(p));      p += 8;
+      v2 = xxh64_round(v2, read64(p));      p += 8;
+      v3 = xxh64_round(v3, read64(p));      p += 8;
+      v4 = xxh64_round(v4, read64(p));      p += 8;
+    } while (p <= limit);
+    hash = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+    hash = xxh64_merge_round(hash, v1);
+    hash = xxh64_merge_round(hash, v2);
+    hash = xxh64_merge_round(hash, v3);
+    hash = xxh64_merge_round(hash, v4);
+  }
+  else
+    hash = xxh_prime5;
+  hash += data.length();
+  for (; p + 8 <= end ; p += 8)
+    hash = rotl64(hash ^ xxh64_round(0, read64(p)), 27) * xxh_prime1 + xxh_prime4;
+  if (p + 4 <= end)
+  {
+    hash = rotl64(hash ^ (std::uint64_t(read32(p)) * xxh_prime1), 23) * xxh_prime2 + xxh_prime3;
+    p += 4;
+  }
+  for (; p < end ; ++p)
+    hash = rotl64(hash ^ (*p * xxh_prime5), 11) * xxh_prime1;
+  hash ^= hash >> 33;
+  hash *= xxh_prime2;
+  hash ^= hash >> 29;
+  hash *= xxh_prime3;
+  hash ^= hash >> 32;
+  return hash;
+}
+
+static std::string evp_digest(const EVP_MD* type, std::string_view data)
+{
+  unsigned char result[EVP_MAX_MD_SIZE];
+  unsigned int  length = 0;
+
+  if (EVP_Digest(data.data(), data.length(), result, &length, type, nullptr) != 1)
+    return "";
+  return to_hex(result, length);
+}
+
+bool get_digest_algorithm(const std::string& name, DigestAlgorithm& algorithm)
+{
+  if (name == "md5")
+    algorithm = Md5Digest;
+  else if (name == "xxh64")
+    algorithm = Xxh64Digest;
+  else if (name == "blake2")
+    algorithm = Blake2Digest;
+  else
+    return false;
+  return true;
+}
+
+std::string digest(DigestAlgorithm algorithm, std::string_view data)
+{
+  switch (algorithm)
+  {
+  case Xxh64Digest:
+  {
+    std::uint64_t hash = xxh64(data);
+    unsigned char bytes[8];
+
+    for (int i = 0 ; i < 8 ; ++i)
+      bytes[i] = static_cast<unsigned char>(hash >> (56 - i * 8));
+    return to_hex(bytes, 8);
+  }
+  case Blake2Digest:
+    return evp_digest(EVP_blake2s256(), data);
+  case Md5Digest:
+    break ;
+  }
+  return evp_digest(EVP_md5(), data);
+}
+
+bool file_digest(DigestAlgorithm algorithm, const std::filesystem::path& source, std::string& output)
+{
+  MappedFile file(source);
+
+  if (file.is_open())
+  {
+    output = digest(algorithm, file.data());
+    return output.length() > 0;
+  }
+  return false;
+}
+
+// Subresource Integrity value, as used by the integrity attribute of <script> and <link>
+std::string subresource_integrity(std::string_view data)
+{
+  unsigned char result[EVP_MAX_MD_SIZE];
+  unsigned char encoded[EVP_MAX_MD_SIZE * 2];
+  unsigned int  length = 0;
+
+  if (EVP_Digest(data.data(), data.length(), result, &length, EVP_sha384(), nullptr) != 1)
+    return "";
+  EVP_EncodeBlock(encoded, result, length);
+  return "sha384-" + std::string(reinterpret_cast<char*>(encoded));
+}
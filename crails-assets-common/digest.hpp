@@ -0,0 +1,16 @@
+#pragma once
+#include <filesystem>
+#include <string>
+#include <string_view>
+
+enum DigestAlgorithm
+{
+  Md5Digest,
+  Xxh64Digest,
+  Blake2Digest
+};
+
+bool        get_digest_algorithm(const std::string& name, DigestAlgorithm& algorithm);
+std::string digest(DigestAlgorithm algorithm, std::string_view data);
+std::string subresource_integrity(std::string_view data);
+bool        file_digest(DigestAlgorithm algorithm, const std::filesystem::path& source, std::string& output);
@@ -0,0 +1,41 @@
+#include "mapped_file.hpp"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+MappedFile::MappedFile(const std::filesystem::path& path)
+{
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  struct stat info;
+
+  if (fd < 0)
+    return ;
+  if (fstat(fd, &info) == 0)
+  {
+    length = info.st_size;
+    if (length == 0)
+      opened = true;
+    else
+    {
+      address = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (address != MAP_FAILED)
+      {
+        madvise(address, length, MADV_SEQUENTIAL);
+        opened = true;
+      }
+      else
+      {
+        address = nullptr;
+        length = 0;
+      }
+    }
+  }
+  close(fd);
+}
+
+MappedFile::~MappedFile()
+{
+  if (address)
+    munmap(address, length);
+}
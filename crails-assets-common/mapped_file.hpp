@@ -0,0 +1,19 @@
+#pragma once
+#include <filesystem>
+#include <string_view>
+
+class MappedFile
+{
+public:
+  MappedFile(const std::filesystem::path& path);
+  MappedFile(const MappedFile&) = delete;
+  ~MappedFile();
+
+  bool             is_open() const { return opened; }
+  std::string_view data() const { return std::string_view(static_cast<const char*>(address), length); }
+  std::size_t      size() const { return length; }
+private:
+  void*       address = nullptr;
+  std::size_t length = 0;
+  bool        opened = false;
+};
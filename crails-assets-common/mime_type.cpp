@@ -0,0 +1,56 @@
+#include "mime_type.hpp"
+#include <map>
+#include <string>
+
+static const std::map<std::string, std::string_view> mime_types{
+  {".avif",  "image/avif"},
+  {".bmp",   "image/bmp"},
+  {".br",    "application/x-brotli"},
+  {".css",   "text/css"},
+  {".csv",   "text/csv"},
+  {".eot",   "application/vnd.ms-fontobject"},
+  {".gif",   "image/gif"},
+  {".gz",    "application/gzip"},
+  {".htm",   "text/html"},
+  {".html",  "text/html"},
+  {".ico",   "image/vnd.microsoft.icon"},
+  {".jpeg",  "image/jpeg"},
+  {".jpg",   "image/jpeg"},
+  {".js",    "text/javascript"},
+  {".json",  "application/json"},
+  {".map",   "application/json"},
+  {".mjs",   "text/javascript"},
+  {".mp3",   "audio/mpeg"},
+  {".mp4",   "video/mp4"},
+  {".ogg",   "audio/ogg"},
+  {".otf",   "font/otf"},
+  {".pdf",   "application/pdf"},
+  {".png",   "image/png"},
+  {".svg",   "image/svg+xml"},
+  {".ttf",   "font/ttf"},
+  {".txt",   "text/plain"},
+  {".wasm",  "application/wasm"},
+  {".webm",  "video/webm"},
+  {".webp",  "image/webp"},
+  {".woff",  "font/woff"},
+  {".woff2", "font/woff2"},
+  {".xml",   "application/xml"},
+  {".zip",   "application/zip"}
+};
+
+std::string_view mime_type_for(const std::filesystem::path& path)
+{
+  auto it = mime_types.find(path.extension().string());
+
+  if (it != mime_types.end())
+    return it->second;
+  return "application/octet-stream";
+}
+
+// Patterns are either a full MIME type (image/png), or a MIME type family (image/*)
+bool mime_type_matches(std::string_view pattern, std::string_view mime_type)
+{
+  if (pattern.length() > 2 && pattern.substr(pattern.length() - 2) == "/*")
+    return mime_type.substr(0, pattern.length() - 1) == pattern.substr(0, pattern.length() - 1);
+  return pattern == mime_type;
+}
@@ -0,0 +1,6 @@
+#pragma once
+#include <filesystem>
+#include <string_view>
+
+std::string_view mime_type_for(const std::filesystem::path& path);
+bool             mime_type_matches(std::string_view pattern, std::string_view mime_type);
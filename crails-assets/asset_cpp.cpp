@@ -1,13 +1,23 @@
 #include <crails/cli/filesystem.hpp>
+#include <crails/read_file.hpp>
+#include <filesystem>
 #include <sstream>
 #include <iostream>
-#include <regex>
+#include <unordered_set>
+#include <crails/utils/split.hpp>
 #include "file_mapper.hpp"
 #include "exclusion_pattern.hpp"
+#include "asset_register.hpp"
+#include "manifest.hpp"
+#include "responsive_images.hpp"
 
 std::string public_path_for(const std::pair<std::string, std::string>& name_and_checksum);
 
+extern bool split_register;
+extern bool verbose_mode;
+
 static const std::string_view assets_ns = "Assets";
+static const std::string lookup_header = "assets/_lookup.hpp";
 
 const unsigned short max_characters_in_variable_name = 255;
 const std::vector<std::string> reserved_keywords{
@@ -53,52 +63,258 @@ static std::string filepath_to_varname(const std::string& filepath)
   return output;
 }
 
-bool generate_reference_files(const FileMapper& file_map, std::string_view output_path, const ExclusionPattern& exclusion_pattern)
+// Register files are included by most of an application's views: they are
+// only written when their contents change, to avoid needless recompilations.
+static bool write_if_changed(const std::string& path, const std::string& contents)
 {
-  std::stringstream stream_hpp, stream_cpp, stream_js;
-  std::string_view assets_ns = "Assets";
-  std::map<std::string, std::string> varname_map;
+  std::string current;
+
+  if (Crails::read_file(path, current) && current == contents)
+    return true;
+  return Crails::write_file("crails-assets", path, contents);
+}
+
+static bool check_varname(const std::string& key, const std::string& varname, std::map<std::string, std::string>& varname_map)
+{
+  if (varname_map.find(varname) != varname_map.end())
+  {
+    std::cerr << "Cannot generate a variable name for `" << key << "`: duplicate with `" << varname_map.at(varname) << '`' << std::endl;
+    return false;
+  }
+  varname_map.emplace(varname, key);
+  if (varname.length() > max_characters_in_variable_name)
+  {
+    std::cerr << "Cannot generate a variable name for `" << key << "`: path is too long." << std::endl;
+    return false;
+  }
+  return true;
+}
+
+static std::string generate_js_register(const FileMapper& file_map)
+{
+  std::stringstream stream_js;
 
-  stream_hpp << "#ifndef APPLICATION_ASSETS_HPP" << std::endl;
-  stream_hpp << "#define APPLICATION_ASSETS_HPP" << std::endl;
-  stream_hpp << "namespace " << assets_ns << std::endl << '{' << std::endl;
-  stream_cpp << "#include \"assets.hpp\"" << std::endl;
-  stream_cpp << "namespace " << assets_ns << std::endl << '{' << std::endl;
   stream_js << "export const " << assets_ns << " = {";
+  for (auto it = file_map.begin() ; it != file_map.end() ; ++it)
+  {
+    if (it != file_map.begin()) stream_js << ',';
+    stream_js << std::endl << "  \"" << file_map.get_alias(it->first) << "\": \"" << public_path_for({it->first, it->second}) << '"';
+  }
+  stream_js << std::endl << '}' << std::endl;
+  return stream_js.str();
+}
+
+// Assets are declared in one header per directory of their alias, with the
+// assets at the root of the input folders in assets/root.hpp. The lookup
+// table gets a reserved name, which a _lookup directory would collide with.
+static std::string register_header_for(const std::string& alias)
+{
+  std::string directory = std::filesystem::path(alias).parent_path().string();
+
+  return "assets/" + (directory.length() > 0 ? directory : std::string("root")) + ".hpp";
+}
+
+static std::string header_guard_for(const std::string& header)
+{
+  std::string guard = "APPLICATION_" + filepath_to_varname(header);
+
+  std::transform(guard.begin(), guard.end(), guard.begin(), ::toupper);
+  return guard;
+}
+
+static bool generate_split_reference_files(const FileMapper& file_map, std::string_view output_path, const ExclusionPattern& exclusion_pattern)
+{
+  std::map<std::string, std::stringstream> headers;
+  std::map<std::string, std::string> varname_map;
+  std::vector<std::pair<std::string, std::string>> entries;
+  std::stringstream stream_hpp, stream_lookup, stream_cpp;
+  std::filesystem::path register_directory = std::string(output_path) + "/assets";
+  std::vector<std::filesystem::path> stale_headers;
+
   for (auto it = file_map.begin() ; it != file_map.end() ; ++it)
   {
     std::string alias = file_map.get_alias(it->first);
     std::string varname = filepath_to_varname(alias);
+    std::string header = register_header_for(alias);
+    auto srcsets = responsive_images.srcsets(file_map, it->first);
 
-    if (varname_map.find(varname) != varname_map.end())
+    if (header == lookup_header)
     {
-      std::cerr << "Cannot generate a variable name for `" << it->first << "`: duplicate with `" << varname_map.at(varname) << '`' << std::endl;
+      std::cerr << "Cannot generate a register header for `" << it->first << "`: " << lookup_header << " is reserved for the lookup table" << std::endl;
       return false;
     }
-    varname_map.emplace(varname, it->first);
-    if (varname.length() > max_characters_in_variable_name)
+    if (!check_varname(it->first, varname, varname_map))
+      return false;
+    for (const auto& srcset : srcsets)
     {
-      std::cerr << "Cannot generate a variable name for `" << it->first << "`: path is too long." << std::endl;
+      if (!check_varname(it->first, varname + '_' + srcset.first, varname_map))
+        return false;
+    }
+    if (headers.find(header) == headers.end())
+    {
+      headers[header] << "#ifndef " << header_guard_for(header) << std::endl
+                      << "#define " << header_guard_for(header) << std::endl
+                      << "#include <string_view>" << std::endl
+                      << "namespace " << assets_ns << std::endl << '{' << std::endl;
+    }
+    exclusion_pattern.protect(it->first, headers[header], [&]()
+    {
+      headers[header] << "  inline constexpr std::string_view " << varname << " = \"" << public_path_for({it->first, it->second}) << "\";" << std::endl;
+      for (const auto& srcset : srcsets)
+        headers[header] << "  inline constexpr std::string_view " << varname << '_' << srcset.first << " = \"" << srcset.second << "\";" << std::endl;
+    });
+    entries.emplace_back(alias, it->first);
+  }
+
+  // The lookup table is sorted by alias, to be searched by dichotomy
+  std::sort(entries.begin(), entries.end());
+  stream_lookup << "#ifndef " << header_guard_for(lookup_header) << std::endl
+                << "#define " << header_guard_for(lookup_header) << std::endl
+                << "#include <string_view>" << std::endl
+                << "#include <iterator>" << std::endl
+                << "namespace " << assets_ns << "::Register" << std::endl << '{' << std::endl
+                << "  struct Entry" << std::endl
+                << "  {" << std::endl
+                << "    std::string_view alias;" << std::endl
+                << "    std::string_view path;" << std::endl
+                << "  };" << std::endl << std::endl
+                << "  inline constexpr Entry entries[] = {" << std::endl;
+  for (const auto& entry : entries)
+  {
+    exclusion_pattern.protect(entry.second, stream_lookup, [&]()
+    { stream_lookup << "    {\"" << entry.first << "\", \"" << public_path_for({entry.second, file_map.at(entry.second)}) << "\"}," << std::endl; });
+  }
+  // The last entry is a sentinel, which keeps the array from being empty
+  stream_lookup << "    {}" << std::endl
+                << "  };" << std::endl << std::endl
+                << "  // Returns the public path of an asset, or an empty string for unknown assets" << std::endl
+                << "  constexpr std::string_view find(std::string_view alias)" << std::endl
+                << "  {" << std::endl
+                << "    std::size_t first = 0, last = std::size(entries) - 1;" << std::endl << std::endl
+                << "    while (first < last)" << std::endl
+                << "    {" << std::endl
+                << "      std::size_t middle = first + (last - first) / 2;" << std::endl << std::endl
+                << "      if (entries[middle].alias < alias)" << std::endl
+                << "        first = middle + 1;" << std::endl
+                << "      else" << std::endl
+                << "        last = middle;" << std::endl
+                << "    }" << std::endl
+                << "    return entries[first].alias == alias ? entries[first].path : std::string_view();" << std::endl
+                << "  }" << std::endl
+                << '}' << std::endl << "#endif" << std::endl;
+
+  stream_hpp << "#ifndef APPLICATION_ASSETS_HPP" << std::endl
+             << "#define APPLICATION_ASSETS_HPP" << std::endl;
+  for (auto& header : headers)
+  {
+    header.second << '}' << std::endl << "#endif" << std::endl;
+    stream_hpp << "#include \"" << header.first << '"' << std::endl;
+  }
+  stream_hpp << "#endif" << std::endl;
+  stream_cpp << "// Assets are declared in the headers of the assets folder" << std::endl;
+
+  // Remove the headers of directories which no longer hold any assets
+  std::filesystem::create_directories(register_directory);
+  for (const auto& entry : std::filesystem::recursive_directory_iterator(register_directory))
+  {
+    std::string header = "assets/" + std::filesystem::relative(entry.path(), register_directory).string();
+
+    if (entry.path().extension() == ".hpp" && header != lookup_header && headers.find(header) == headers.end())
+      stale_headers.push_back(entry.path());
+  }
+  for (const auto& stale_header : stale_headers)
+    std::filesystem::remove(stale_header);
+  for (const auto& header : headers)
+  {
+    std::filesystem::path header_path = std::string(output_path) + '/' + header.first;
+
+    std::filesystem::create_directories(header_path.parent_path());
+    if (!write_if_changed(header_path.string(), header.second.str()))
       return false;
+  }
+  return write_if_changed(std::string(output_path) + '/' + lookup_header, stream_lookup.str())
+      && write_if_changed(std::string(output_path) + "/assets.hpp", stream_hpp.str())
+      && write_if_changed(std::string(output_path) + "/assets.cpp", stream_cpp.str())
+      && write_if_changed(std::string(output_path) + "/assets.js", generate_js_register(file_map));
+}
+
+// Each run records the variables it registered along with its public folder,
+// so that --update can remove the assets deleted since the previous run,
+// without touching the variables registered by runs on other folders.
+static std::string owned_varnames_path(std::string_view public_directory)
+{
+  return std::string(public_directory) + "/.crails-assets.register";
+}
+
+static std::unordered_set<std::string> load_owned_varnames(std::string_view public_directory)
+{
+  std::unordered_set<std::string> varnames;
+  std::string contents;
+
+  if (Crails::read_file(owned_varnames_path(public_directory), contents))
+  {
+    for (const std::string& varname : Crails::split(contents, '\n'))
+      varnames.insert(varname);
+  }
+  return varnames;
+}
+
+static bool register_assets(const FileMapper& file_map, const ExclusionPattern& exclusion_pattern, AssetRegister& asset_register, std::vector<std::string>& varnames)
+{
+  std::map<std::string, std::string> varname_map;
+
+  for (auto it = file_map.begin() ; it != file_map.end() ; ++it)
+  {
+    std::string alias = file_map.get_alias(it->first);
+    std::string varname = filepath_to_varname(alias);
+
+    if (!check_varname(it->first, varname, varname_map))
+      return false;
+    asset_register.set(varname, public_path_for({it->first, it->second}), exclusion_pattern.define_for(it->first));
+    varnames.push_back(varname);
+
+    // Responsive images also get the srcset of their variants (ex: images_logo_png_srcset)
+    for (const auto& srcset : responsive_images.srcsets(file_map, it->first))
+    {
+      std::string srcset_varname = varname + '_' + srcset.first;
+
+      if (!check_varname(it->first, srcset_varname, varname_map))
+        return false;
+      asset_register.set(srcset_varname, srcset.second, exclusion_pattern.define_for(it->first));
+      varnames.push_back(srcset_varname);
     }
-    exclusion_pattern.protect(it->first, stream_hpp, [&]()
-    { stream_hpp << "  extern const char* " << varname << ';' << std::endl; });
-    exclusion_pattern.protect(it->first, stream_cpp, [&]()
-    { stream_cpp << "  const char* " << varname << " = \"" << public_path_for({it->first, it->second}) << "\";" << std::endl; });
-    if (it != file_map.begin()) stream_js << ',' << std::endl;
-    stream_js << "  \"" << alias << "\": \"" << public_path_for({it->first, it->second});
   }
-  stream_js << std::endl << '}' << std::endl;
-  stream_cpp << '}' << std::endl;
-  stream_hpp << '}' << std::endl << "#endif" << std::endl;
-  Crails::write_file("crails-assets", output_path.data() + std::string("/assets.hpp"), stream_hpp.str());
-  Crails::write_file("crails-assets", output_path.data() + std::string("/assets.cpp"), stream_cpp.str());
-  Crails::write_file("crails-assets", output_path.data() + std::string("/assets.js"),  stream_js.str());
   return true;
 }
 
-bool update_reference_files(const FileMapper& file_map, std::string_view output_path, const ExclusionPattern& exclusion_pattern)
+static bool save_owned_varnames(std::string_view public_directory, const std::vector<std::string>& varnames)
+{
+  std::stringstream stream;
+
+  for (const std::string& varname : varnames)
+    stream << varname << std::endl;
+  return write_if_changed(owned_varnames_path(public_directory), stream.str());
+}
+
+bool generate_reference_files(const FileMapper& file_map, std::string_view output_path, std::string_view public_directory, const ExclusionPattern& exclusion_pattern)
+{
+  AssetRegister asset_register(assets_ns);
+  std::vector<std::string> varnames;
+
+  if (split_register)
+    return generate_split_reference_files(file_map, output_path, exclusion_pattern);
+  return register_assets(file_map, exclusion_pattern, asset_register, varnames)
+      && write_if_changed(output_path.data() + std::string("/assets.hpp"), asset_register.header())
+      && write_if_changed(output_path.data() + std::string("/assets.cpp"), asset_register.source())
+      && write_if_changed(output_path.data() + std::string("/assets.js"),  generate_js_register(file_map))
+      && save_owned_varnames(public_directory, varnames);
+}
+
+bool update_reference_files(const FileMapper& file_map, std::string_view output_path, std::string_view public_directory, const ExclusionPattern& exclusion_pattern)
 {
+  AssetRegister asset_register(assets_ns);
+  std::vector<std::string> varnames;
+  std::unordered_set<std::string> registered_varnames;
   std::string assets_hpp;
   std::string assets_cpp;
   bool loaded;
@@ -110,51 +326,60 @@ bool update_reference_files(const FileMapper& file_map, std::string_view output_
     std::cerr << "Could not open assets.hpp and/or assets.cpp" << std::endl;
     return false;
   }
+  if (!asset_register.parse(assets_hpp, assets_cpp))
+  {
+    std::cerr << "Broken register in assets.cpp. Restart without the --update option" << std::endl;
+    return false;
+  }
+  if (!register_assets(file_map, exclusion_pattern, asset_register, varnames))
+    return false;
+  registered_varnames.insert(varnames.begin(), varnames.end());
+  for (const std::string& varname : load_owned_varnames(public_directory))
+  {
+    if (registered_varnames.count(varname))
+      continue ;
+    if (asset_register.remove(varname) && verbose_mode)
+      std::cout << "[crails-assets] removing " << varname << " from the register" << std::endl;
+  }
+  return write_if_changed(output_path.data() + std::string("/assets.hpp"), asset_register.header())
+      && write_if_changed(output_path.data() + std::string("/assets.cpp"), asset_register.source())
+      && save_owned_varnames(public_directory, varnames);
+}
+
+// Integrity values change along with the contents of the assets: they are
+// declared in their own header, so that only the views using them get
+// recompiled. When updating, the values registered by other runs are kept.
+bool generate_integrity_file(const FileMapper& file_map, const AssetManifest& manifest, std::string_view output_path, std::string_view public_directory, bool update)
+{
+  std::string path = output_path.data() + std::string("/assets_integrity.hpp");
+  std::unordered_set<std::string> owned_varnames = load_owned_varnames(public_directory);
+  std::stringstream stream;
+  std::string current;
+
+  stream << "#ifndef APPLICATION_ASSETS_INTEGRITY_HPP" << std::endl;
+  stream << "#define APPLICATION_ASSETS_INTEGRITY_HPP" << std::endl;
+  stream << "namespace " << assets_ns << std::endl << '{' << std::endl;
+  stream << "  namespace Integrity" << std::endl << "  {" << std::endl;
   for (auto it = file_map.begin() ; it != file_map.end() ; ++it)
   {
-    std::string alias = file_map.get_alias(it->first);
-    std::string varname = filepath_to_varname(alias);
-    std::string pattern("extern const char* " + varname);
+    std::string varname = filepath_to_varname(file_map.get_alias(it->first));
+    auto entry = manifest.find(it->first);
 
-    if (assets_hpp.find(pattern) == std::string::npos)
-    {
-      stringstream stream_hpp, stream_cpp;
-      auto add_pattern = std::string("namespace ") + assets_ns.data() + "\n{\n";
-      auto hpp_start_at = assets_hpp.find(add_pattern);
-      auto cpp_start_at = assets_cpp.find(add_pattern);
-
-      stream_hpp << assets_hpp.substr(0, hpp_start_at) << add_pattern;
-      stream_cpp << assets_cpp.substr(0, cpp_start_at) << add_pattern;
-      exclusion_pattern.protect(it->first, stream_hpp, [&]()
-      { stream_hpp << "  extern const char* " << varname << ';' << std::endl; });
-      exclusion_pattern.protect(it->first, stream_cpp, [&]()
-      { stream_cpp << "  const char* " << varname << " = \"" << public_path_for({it->first, it->second}) << "\";" << std::endl; });
-      stream_hpp << assets_hpp.substr(hpp_start_at + add_pattern.length());
-      stream_cpp << assets_cpp.substr(cpp_start_at + add_pattern.length());
-      assets_hpp = stream_hpp.str();
-      assets_cpp = stream_cpp.str();
-    }
-    else
+    if (entry != manifest.end() && entry->second.integrity.length() > 0)
+      stream << "    inline constexpr const char* " << varname << " = \"" << entry->second.integrity << "\";" << std::endl;
+    owned_varnames.insert(varname);
+  }
+  if (update && Crails::read_file(path, current))
+  {
+    for (const std::string& line : Crails::split(current, '\n'))
     {
-      stringstream stream_cpp;
-      std::regex cpp_pattern("const\\schar\\*\\s" + varname + "\\s=\\s\"[^\"]+\";");
-      auto match = std::sregex_iterator(assets_cpp.begin(), assets_cpp.end(), cpp_pattern);
-
-      if (match != std::sregex_iterator())
-      {
-        stream_cpp << assets_cpp.substr(0, match->position());
-        stream_cpp << "const char* " << varname << " = \"" << public_path_for({it->first, it->second}) << "\";";
-        stream_cpp << assets_cpp.substr(match->position() + match->length());
-        assets_cpp = stream_cpp.str();
-      }
-      else
-      {
-        std::cerr << "Broken register in assets.cpp. Restart without the --update option" << std::endl;
-        return false;
-      }
+      std::string prefix = "    inline constexpr const char* ";
+      std::string varname = line.substr(0, line.find(" = ")).substr(std::min(prefix.length(), line.length()));
+
+      if (line.starts_with(prefix) && !owned_varnames.count(varname))
+        stream << line << std::endl;
     }
   }
-  Crails::write_file("crails-assets", output_path.data() + std::string("/assets.hpp"), assets_hpp);
-  Crails::write_file("crails-assets", output_path.data() + std::string("/assets.cpp"), assets_cpp);
-  return true;
+  stream << "  }" << std::endl << '}' << std::endl << "#endif" << std::endl;
+  return write_if_changed(path, stream.str());
 }
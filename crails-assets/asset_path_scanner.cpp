@@ -0,0 +1,187 @@
+#include "asset_path_scanner.hpp"
+#include <algorithm>
+#include <cstring>
+
+static const std::string_view asset_path_prefix = "asset_path(\"";
+static const std::size_t      asset_path_underscore = 5;
+
+// Finds the next asset_path("alias") call, starting at `position`. The search
+// jumps from one underscore to the next with memchr, as underscores are much
+// less frequent than the first letter of the prefix. On success, `position`
+// is the start of the call, and `alias` its parameter.
+static bool find_next_asset_path(std::string_view contents, std::size_t& position, std::string_view& alias)
+{
+  const char* begin = contents.data();
+  const char* end = begin + contents.length();
+  const char* cursor = begin + std::min(position + asset_path_underscore, contents.length());
+
+  while (cursor < end && (cursor = static_cast<const char*>(std::memchr(cursor, '_', end - cursor))))
+  {
+    std::size_t start = cursor - begin - asset_path_underscore;
+
+    cursor++;
+    if (contents.compare(start, asset_path_prefix.length(), asset_path_prefix) == 0)
+    {
+      std::size_t alias_start = start + asset_path_prefix.length();
+      std::size_t alias_end = contents.find('"', alias_start);
+
+      if (alias_end == std::string_view::npos)
+        return false;
+      if (alias_end > alias_start && alias_end + 1 < contents.length() && contents[alias_end + 1] == ')')
+      {
+        position = start;
+        alias = contents.substr(alias_start, alias_end - alias_start);
+        return true;
+      }
+      cursor = begin + alias_end;
+    }
+  }
+  return false;
+}
+
+bool may_reference_assets(const std::filesystem::path& path)
+{
+  std::string extension = path.extension().string();
+
+  return extension == ".scss" || extension == ".sass" || extension == ".css" || extension == ".js"
+      || extension == ".html" || extension == ".htm";
+}
+
+// Lists the aliases a Sass import may resolve to: the file itself, its
+// partial, and the index files of a directory, relative to the importing
+// stylesheet. Candidates that do not exist are ignored by the fingerprints.
+static void add_sass_import_candidates(const std::filesystem::path& directory, std::string_view target, std::vector<std::string>& references)
+{
+  static const std::vector<std::string> extensions{".scss", ".sass", ".css"};
+  std::filesystem::path base = (directory / std::string(target)).lexically_normal();
+  std::string name = base.filename().string();
+
+  if (target.starts_with("sass:") || target.find("://") != std::string_view::npos || target.starts_with("url(") || name.empty() || base.string().starts_with(".."))
+    return ;
+  if (std::find(extensions.begin(), extensions.end(), base.extension().string()) != extensions.end())
+  {
+    references.push_back(base.string());
+    references.push_back((base.parent_path() / ('_' + name)).string());
+    return ;
+  }
+  for (const std::string& extension : extensions)
+  {
+    references.push_back(base.string() + extension);
+    references.push_back((base.parent_path() / ('_' + name + extension)).string());
+    references.push_back((base / ("index" + extension)).string());
+    references.push_back((base / ("_index" + extension)).string());
+  }
+}
+
+// Finds the targets of the @import, @use and @forward rules of a stylesheet.
+// Only @import may list several targets, and targets may be unquoted in the
+// indented syntax.
+static void find_sass_imports(const std::string& alias, std::string_view contents, std::vector<std::string>& references)
+{
+  std::filesystem::path directory = std::filesystem::path(alias).parent_path();
+  std::size_t position = 0;
+
+  while ((position = contents.find('@', position)) != std::string_view::npos)
+  {
+    std::string_view rule = contents.substr(++position);
+    bool is_import = rule.starts_with("import");
+
+    if (!is_import && !rule.starts_with("use") && !rule.starts_with("forward"))
+      continue ;
+    position += is_import ? 6 : (rule.starts_with("use") ? 3 : 7);
+    if (position >= contents.length() || (contents[position] != ' ' && contents[position] != '\t'))
+      continue ;
+    do
+    {
+      std::size_t target_start, target_end;
+
+      position = contents.find_first_not_of(" \t,", position);
+      if (position == std::string_view::npos)
+        return ;
+      if (contents[position] == '"' || contents[position] == '\'')
+      {
+        target_start = position + 1;
+        target_end = contents.find(contents[position], target_start);
+        if (target_end == std::string_view::npos)
+          return ;
+        position = target_end + 1;
+      }
+      else
+      {
+        target_start = position;
+        target_end = std::min(contents.find_first_of(" \t\r\n,;", target_start), contents.length());
+        position = target_end;
+      }
+      add_sass_import_candidates(directory, contents.substr(target_start, target_end - target_start), references);
+      position = contents.find_first_not_of(" \t", position);
+    }
+    while (is_import && position != std::string_view::npos && contents[position] == ',');
+  }
+}
+
+// Lists the aliases referenced by an asset: the parameters of each
+// asset_path("...") call, the stylesheets imported by Sass stylesheets, and
+// the WebAssembly module loaded by a comet javascript file, which is named
+// after the javascript file itself.
+std::vector<std::string> find_asset_references(const std::filesystem::path& path, const std::string& alias, std::string_view contents)
+{
+  std::vector<std::string> references;
+  std::size_t position = 0;
+  std::string_view reference;
+
+  while (find_next_asset_path(contents, position, reference))
+  {
+    references.emplace_back(reference);
+    position += asset_path_prefix.length() + reference.length() + 2;
+  }
+  if (path.extension() == ".scss" || path.extension() == ".sass")
+    find_sass_imports(alias, contents, references);
+  if (path.extension() == ".js")
+  {
+    std::string wasm_pattern = '\'' + std::filesystem::path(path).replace_extension("wasm").filename().string() + '\'';
+
+    if (contents.find(wasm_pattern) != std::string_view::npos)
+      references.push_back(std::filesystem::path(alias).replace_extension("wasm").string());
+  }
+  std::sort(references.begin(), references.end());
+  references.erase(std::unique(references.begin(), references.end()), references.end());
+  return references;
+}
+
+// Copies `contents` into `output`, replacing each asset_path("alias") call with
+// the public path given by `resolve`, in a single pass. Every alias that cannot
+// be resolved is appended to `missing`, and the calls referencing it are kept
+// as they are.
+bool rewrite_asset_paths(std::string_view contents, std::string& output, const AssetPathResolver& resolve, std::vector<std::string>& missing, bool quoted)
+{
+  std::size_t position = 0, last_position = 0;
+  std::string_view alias;
+  std::string public_path;
+  bool success = true;
+
+  output.clear();
+  output.reserve(contents.length() + contents.length() / 16);
+  while (find_next_asset_path(contents, position, alias))
+  {
+    std::size_t call_length = asset_path_prefix.length() + alias.length() + 2;
+
+    if (resolve(alias, public_path))
+    {
+      output.append(contents.substr(last_position, position - last_position));
+      if (quoted)
+        output += '"';
+      output += public_path;
+      if (quoted)
+        output += '"';
+      last_position = position + call_length;
+    }
+    else
+    {
+      missing.emplace_back(alias);
+      success = false;
+    }
+    position += call_length;
+  }
+  output.append(contents.substr(last_position));
+  return success;
+}
@@ -0,0 +1,13 @@
+#pragma once
+#include <filesystem>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+typedef std::function<bool(std::string_view alias, std::string& public_path)> AssetPathResolver;
+typedef std::function<bool(std::string_view input, std::string& output)>       PostFilter;
+
+bool                     may_reference_assets(const std::filesystem::path& path);
+std::vector<std::string> find_asset_references(const std::filesystem::path& path, const std::string& alias, std::string_view contents);
+bool                     rewrite_asset_paths(std::string_view contents, std::string& output, const AssetPathResolver& resolve, std::vector<std::string>& missing, bool quoted = false);
@@ -0,0 +1,148 @@
+#include "asset_register.hpp"
+#include <unordered_set>
+#include <sstream>
+#include <iostream>
+
+static const std::string_view header_declaration = "extern const char* ";
+static const std::string_view source_definition = "const char* ";
+
+static std::string_view trim(std::string_view line)
+{
+  while (line.length() > 0 && (line.front() == ' ' || line.front() == '\t'))
+    line.remove_prefix(1);
+  while (line.length() > 0 && (line.back() == ' ' || line.back() == '\t' || line.back() == '\r'))
+    line.remove_suffix(1);
+  return line;
+}
+
+template<typename CALLBACK>
+static bool each_line(std::string_view contents, CALLBACK callback)
+{
+  while (contents.length() > 0)
+  {
+    std::size_t end = contents.find('\n');
+
+    if (!callback(trim(contents.substr(0, end))))
+      return false;
+    if (end == std::string_view::npos)
+      break ;
+    contents.remove_prefix(end + 1);
+  }
+  return true;
+}
+
+static bool parse_definition(std::string_view line, std::string_view& varname, std::string_view& path)
+{
+  std::size_t separator;
+
+  line.remove_prefix(source_definition.length());
+  separator = line.find(" = \"");
+  if (separator == std::string_view::npos || !line.ends_with("\";"))
+    return false;
+  varname = line.substr(0, separator);
+  path = line.substr(separator + 4, line.length() - separator - 6);
+  return varname.length() > 0 && path.find('"') == std::string_view::npos;
+}
+
+bool AssetRegister::parse(std::string_view header, std::string_view source)
+{
+  std::unordered_set<std::string_view> declarations;
+  std::string define;
+  bool parsed;
+
+  entries.clear();
+  indexes.clear();
+  parsed = each_line(header, [&](std::string_view line)
+  {
+    if (line.starts_with(header_declaration) && line.ends_with(";"))
+      declarations.insert(line.substr(header_declaration.length(), line.length() - header_declaration.length() - 1));
+    return true;
+  });
+  parsed = parsed && each_line(source, [&](std::string_view line)
+  {
+    std::string_view varname, path;
+
+    if (line.starts_with("#ifndef "))
+      define = trim(line.substr(8));
+    else if (line.starts_with("#endif"))
+      define.clear();
+    else if (line.starts_with(source_definition))
+    {
+      if (!parse_definition(line, varname, path) || !declarations.count(varname))
+        return false;
+      set(std::string(varname), std::string(path), define);
+    }
+    return true;
+  });
+  return parsed && entries.size() == declarations.size();
+}
+
+void AssetRegister::set(const std::string& varname, const std::string& path, const std::string& define)
+{
+  auto it = indexes.find(varname);
+
+  if (it == indexes.end())
+  {
+    indexes.emplace(varname, entries.size());
+    entries.push_back({varname, path, define});
+  }
+  else
+  {
+    Entry& entry = entries[it->second];
+
+    entry.path = path;
+    entry.define = define;
+    entry.removed = false;
+  }
+}
+
+bool AssetRegister::remove(const std::string& varname)
+{
+  auto it = indexes.find(varname);
+
+  if (it == indexes.end() || entries[it->second].removed)
+    return false;
+  entries[it->second].removed = true;
+  return true;
+}
+
+template<typename CALLBACK>
+static void protect(std::stringstream& stream, const AssetRegister::Entry& entry, CALLBACK callback)
+{
+  if (entry.define.length() > 0)
+    stream << "#ifndef " << entry.define << std::endl;
+  callback();
+  if (entry.define.length() > 0)
+    stream << "#endif " << std::endl;
+}
+
+std::string AssetRegister::header() const
+{
+  std::stringstream stream;
+
+  stream << "#ifndef APPLICATION_ASSETS_HPP" << std::endl;
+  stream << "#define APPLICATION_ASSETS_HPP" << std::endl;
+  stream << "namespace " << ns << std::endl << '{' << std::endl;
+  for (const Entry& entry : entries)
+  {
+    if (!entry.removed)
+      protect(stream, entry, [&]() { stream << "  " << header_declaration << entry.varname << ';' << std::endl; });
+  }
+  stream << '}' << std::endl << "#endif" << std::endl;
+  return stream.str();
+}
+
+std::string AssetRegister::source() const
+{
+  std::stringstream stream;
+
+  stream << "#include \"assets.hpp\"" << std::endl;
+  stream << "namespace " << ns << std::endl << '{' << std::endl;
+  for (const Entry& entry : entries)
+  {
+    if (!entry.removed)
+      protect(stream, entry, [&]() { stream << "  " << source_definition << entry.varname << " = \"" << entry.path << "\";" << std::endl; });
+  }
+  stream << '}' << std::endl;
+  return stream.str();
+}
@@ -0,0 +1,32 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unordered_map>
+
+// Model of a monolithic register (assets.hpp and assets.cpp): the existing
+// files are parsed once, updated in memory, then serialized once.
+class AssetRegister
+{
+public:
+  struct Entry
+  {
+    std::string varname;
+    std::string path;
+    std::string define; // set when the entry is protected by an #ifndef
+    bool        removed = false;
+  };
+
+  AssetRegister(std::string_view ns) : ns(ns) {}
+
+  bool parse(std::string_view header, std::string_view source);
+  void set(const std::string& varname, const std::string& path, const std::string& define);
+  bool remove(const std::string& varname);
+  std::string header() const;
+  std::string source() const;
+
+private:
+  std::string ns;
+  std::vector<Entry> entries;
+  std::unordered_map<std::string, std::size_t> indexes;
+};
@@ -0,0 +1,185 @@
+#include "build_cache.hpp"
+#include <sys/stat.h>
+#include <fstream>
+#include <stdexcept>
+#include <iostream>
+
+static const std::string cache_header = "crails-assets-cache 3";
+
+static std::vector<std::string> split_fields(const std::string& line)
+{
+  std::vector<std::string> fields;
+  std::size_t start = 0, end;
+
+  while ((end = line.find('\t', start)) != std::string::npos)
+  {
+    fields.push_back(line.substr(start, end - start));
+    start = end + 1;
+  }
+  fields.push_back(line.substr(start));
+  return fields;
+}
+
+bool stat_file(const std::filesystem::path& path, FileStat& output)
+{
+  struct stat info;
+
+  if (::stat(path.c_str(), &info) == 0)
+  {
+    output.size = info.st_size;
+    output.mtime = static_cast<std::int64_t>(info.st_mtim.tv_sec) * 1000000000 + info.st_mtim.tv_nsec;
+    output.inode = info.st_ino;
+    return true;
+  }
+  return false;
+}
+
+BuildCache::BuildCache(const std::filesystem::path& path, const std::string& hash_signature, const std::string& build_signature)
+  : path(path), hash_signature(hash_signature), build_signature(build_signature)
+{
+}
+
+bool BuildCache::load()
+{
+  std::ifstream stream(path);
+  std::string line, stored_hash_signature, stored_build_signature;
+
+  if (!stream.is_open())
+    return false;
+  if (!std::getline(stream, line) || line != cache_header)
+    return false;
+  std::getline(stream, stored_hash_signature);
+  std::getline(stream, stored_build_signature);
+  if (stored_hash_signature != "hash " + hash_signature)
+    return false;
+  while (std::getline(stream, line))
+  {
+    std::vector<std::string> fields = split_fields(line);
+    BuildCacheEntry entry;
+    std::size_t reference_count, output_count;
+
+    try
+    {
+      if (fields.size() < 8)
+        throw std::invalid_argument("missing fields");
+      entry.stat.size = std::stoull(fields[0]);
+      entry.stat.mtime = std::stoll(fields[1]);
+      entry.stat.inode = std::stoull(fields[2]);
+      entry.digest = fields[3];
+      reference_count = std::stoul(fields[4]);
+      if (fields.size() < reference_count + 8)
+        throw std::invalid_argument("reference count mismatch");
+      output_count = std::stoul(fields[5 + reference_count]);
+      if (fields.size() != reference_count + output_count * 2 + 8)
+        throw std::invalid_argument("output count mismatch");
+      for (std::size_t i = 0 ; i < output_count ; ++i)
+        entry.output_sizes.push_back(std::stoull(fields[6 + reference_count + output_count + i]));
+    }
+    catch (const std::exception&)
+    {
+      std::cerr << "[crails-assets] ignoring corrupted build cache " << path << std::endl;
+      clear();
+      return false;
+    }
+    entry.references.assign(fields.begin() + 5, fields.begin() + 5 + reference_count);
+    if (stored_build_signature == "build " + build_signature)
+    {
+      entry.outputs.assign(fields.begin() + 6 + reference_count, fields.begin() + 6 + reference_count + output_count);
+      entry.integrity = fields[fields.size() - 2];
+    }
+    else
+      entry.output_sizes.clear();
+    emplace(fields.back(), entry);
+  }
+  return true;
+}
+
+bool BuildCache::save() const
+{
+  std::filesystem::path tmp_path = path.string() + ".tmp";
+  std::error_code error;
+
+  if (!is_enabled())
+    return true;
+  {
+    std::ofstream stream(tmp_path);
+
+    if (!stream.is_open())
+    {
+      std::cerr << "[crails-assets] cannot write build cache " << tmp_path << std::endl;
+      return false;
+    }
+    stream << cache_header << '\n'
+           << "hash " << hash_signature << '\n'
+           << "build " << build_signature << '\n';
+    for (const auto& item : *this)
+    {
+      const BuildCacheEntry& entry = item.second;
+
+      stream << entry.stat.size << '\t' << entry.stat.mtime << '\t' << entry.stat.inode << '\t'
+             << entry.digest << '\t' << entry.references.size();
+      for (const std::string& reference : entry.references)
+        stream << '\t' << reference;
+      stream << '\t' << entry.outputs.size();
+      for (const std::string& output : entry.outputs)
+        stream << '\t' << output;
+      for (std::size_t i = 0 ; i < entry.outputs.size() ; ++i)
+        stream << '\t' << (i < entry.output_sizes.size() ? entry.output_sizes[i] : 0);
+      stream << '\t' << entry.integrity << '\t' << item.first << '\n';
+    }
+  }
+  std::filesystem::rename(tmp_path, path, error);
+  return !error;
+}
+
+bool BuildCache::find_digest(const std::string& source, const FileStat& stat, std::string& digest, std::vector<std::string>& references) const
+{
+  auto it = find(source);
+
+  if (it != end() && it->second.stat == stat)
+  {
+    digest = it->second.digest;
+    references = it->second.references;
+    return true;
+  }
+  return false;
+}
+
+void BuildCache::store_digest(const std::string& source, const FileStat& stat, const std::string& digest, const std::vector<std::string>& references)
+{
+  BuildCacheEntry& entry = (*this)[source];
+
+  if (entry.digest != digest)
+  {
+    entry.outputs.clear();
+    entry.output_sizes.clear();
+    entry.integrity.clear();
+  }
+  entry.stat = stat;
+  entry.digest = digest;
+  entry.references = references;
+}
+
+bool BuildCache::is_up_to_date(const std::string& source, const std::filesystem::path& output_path) const
+{
+  if (is_enabled())
+  {
+    auto it = find(source);
+
+    if (it == end() || it->second.outputs.size() == 0 || it->second.outputs.front() != output_path.filename().string())
+      return false;
+  }
+  return std::filesystem::exists(output_path);
+}
+
+void BuildCache::store_outputs(const std::string& source, const std::vector<std::string>& outputs, const std::vector<std::uintmax_t>& output_sizes, const std::string& integrity)
+{
+  if (is_enabled())
+  {
+    BuildCacheEntry& entry = (*this)[source];
+
+    entry.outputs = outputs;
+    entry.output_sizes = output_sizes;
+    entry.integrity = integrity;
+  }
+}
@@ -0,0 +1,53 @@
+#pragma once
+#include <filesystem>
+#include <map>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+struct FileStat
+{
+  std::uintmax_t size = 0;
+  std::int64_t   mtime = 0;
+  std::uint64_t  inode = 0;
+
+  bool operator==(const FileStat& other) const
+  {
+    return size == other.size && mtime == other.mtime && inode == other.inode;
+  }
+};
+
+bool stat_file(const std::filesystem::path& path, FileStat& output);
+
+struct BuildCacheEntry
+{
+  FileStat                 stat;
+  std::string              digest;
+  std::vector<std::string> references;
+  std::vector<std::string> outputs;
+  std::vector<std::uintmax_t> output_sizes;
+  std::string              integrity;
+};
+
+// Maps each source path to the state it had when it was last processed.
+// The hash signature invalidates the digests (digest algorithm), while the
+// build signature invalidates the outputs (tool version, sass implementation,
+// minifier and any option affecting the generated files).
+class BuildCache : public std::map<std::string, BuildCacheEntry>
+{
+public:
+  BuildCache() {}
+  BuildCache(const std::filesystem::path& path, const std::string& hash_signature, const std::string& build_signature);
+
+  bool is_enabled() const { return path.string().length() > 0; }
+  bool load();
+  bool save() const;
+  bool find_digest(const std::string& source, const FileStat& stat, std::string& digest, std::vector<std::string>& references) const;
+  void store_digest(const std::string& source, const FileStat& stat, const std::string& digest, const std::vector<std::string>& references);
+  bool is_up_to_date(const std::string& source, const std::filesystem::path& output_path) const;
+  void store_outputs(const std::string& source, const std::vector<std::string>& outputs, const std::vector<std::uintmax_t>& output_sizes, const std::string& integrity);
+
+private:
+  std::filesystem::path path;
+  std::string hash_signature, build_signature;
+};
@@ -0,0 +1,210 @@
+#include <crails/cli/filesystem.hpp>
+#include <crails/read_file.hpp>
+#include <openssl/evp.h>
+#include <algorithm>
+#include <iostream>
+#include "bundle.hpp"
+#include "file_mapper.hpp"
+#include "job_scheduler.hpp"
+#include "trace.hpp"
+#include "json.hpp"
+
+extern bool with_source_maps;
+extern bool verbose_mode;
+extern const std::string public_scope;
+
+bool public_filename_for(const FileMapper& filemap, const std::string& key, std::string& filename);
+
+static const std::string sourcemap_directive = "sourceMappingURL=";
+
+bool is_bundle(const std::filesystem::path& path)
+{
+  return path.extension() == ".bundle";
+}
+
+std::vector<std::string> find_bundle_parts(std::string_view contents)
+{
+  std::vector<std::string> parts;
+
+  while (contents.length() > 0)
+  {
+    std::size_t line_end = contents.find('\n');
+    std::string_view line = contents.substr(0, line_end);
+    std::size_t first = line.find_first_not_of(" \t\r");
+
+    if (first != std::string_view::npos && line[first] != '#')
+      parts.emplace_back(line.substr(first, line.find_last_not_of(" \t\r") - first + 1));
+    contents.remove_prefix(line_end == std::string_view::npos ? contents.length() : line_end + 1);
+  }
+  return parts;
+}
+
+static std::string decode_base64(std::string_view input)
+{
+  std::string output((input.length() / 4) * 3, '\0');
+  int length;
+
+  if (input.length() % 4 != 0)
+    return "";
+  length = EVP_DecodeBlock(reinterpret_cast<unsigned char*>(output.data()), reinterpret_cast<const unsigned char*>(input.data()), input.length());
+  if (length < 0)
+    return "";
+  for (auto it = input.rbegin() ; it != input.rend() && *it == '=' ; ++it)
+    length--;
+  output.resize(length);
+  return output;
+}
+
+// Removes the sourceMappingURL comment (`//# ...` or `/*# ... */`) left by
+// the minifier or the sass compiler, and returns its url. As specified for
+// sourcemaps, only the last non-blank line of a file may hold that comment:
+// the same text elsewhere is part of the code.
+static std::string remove_sourcemap_comment(std::string& contents)
+{
+  std::size_t content_end = contents.find_last_not_of(" \t\r\n");
+  std::size_t line_start;
+  std::string_view line;
+
+  if (content_end == std::string::npos)
+    return "";
+  line_start = contents.rfind('\n', content_end);
+  line_start = line_start == std::string::npos ? 0 : line_start + 1;
+  line = std::string_view(contents).substr(line_start, content_end + 1 - line_start);
+  line.remove_prefix(std::min(line.find_first_not_of(" \t"), line.length()));
+  for (std::string_view marker : {"//#", "//@", "/*#", "/*@"})
+  {
+    std::string_view directive = line.substr(std::min(marker.length(), line.length()));
+    std::string url;
+
+    directive.remove_prefix(std::min(directive.find_first_not_of(" \t"), directive.length()));
+    if (!line.starts_with(marker) || !directive.starts_with(sourcemap_directive))
+      continue ;
+    if (marker.starts_with("/*") && !line.ends_with("*/"))
+      return "";
+    directive.remove_prefix(sourcemap_directive.length());
+    url = std::string(directive.substr(0, directive.find_first_of(" \t*")));
+    contents.erase(line_start);
+    return url;
+  }
+  return "";
+}
+
+// Sourcemaps are either inlined as base64 data urls, or written next to the
+// part. Index maps cannot be nested, so parts with an index map of their own,
+// or without mappings, are mapped as if they had no sourcemap.
+static std::string load_part_sourcemap(const std::filesystem::path& part_path, const std::string& url)
+{
+  std::string sourcemap;
+
+  if (url.starts_with("data:"))
+  {
+    std::size_t separator = url.find(',');
+
+    if (separator != std::string::npos && url.substr(0, separator).ends_with(";base64"))
+      sourcemap = decode_base64(std::string_view(url).substr(separator + 1));
+  }
+  else if (url.length() > 0 && url.find('/') == std::string::npos)
+    Crails::read_file((part_path.parent_path() / url).string(), sourcemap);
+  else if (std::filesystem::exists(part_path.string() + ".map"))
+    Crails::read_file(part_path.string() + ".map", sourcemap);
+  if (sourcemap.find("\"sections\"") != std::string::npos || sourcemap.find("\"mappings\"") == std::string::npos)
+    sourcemap.clear();
+  return sourcemap;
+}
+
+// Maps each line of a part without sourcemap to the same line of the part
+static std::string identity_sourcemap(const std::string& source, std::size_t line_count)
+{
+  std::string mappings;
+
+  mappings.reserve(line_count * 5);
+  for (std::size_t i = 0 ; i < line_count ; ++i)
+    mappings += i == 0 ? "AAAA" : ";AACA";
+  return "{\"version\":3,\"sources\":[" + json_string(source) + "],\"names\":[],\"mappings\":\"" + mappings + "\"}";
+}
+
+static bool accepts_part(const std::string& bundle_type, const std::string& key)
+{
+  std::string extension = std::filesystem::path(key).extension().string();
+
+  if (bundle_type == ".js")
+    return extension == ".js";
+  return extension == ".css" || extension == ".scss" || extension == ".sass";
+}
+
+// Parts are concatenated from their public files, which generate_js and
+// generate_sass already minified or compiled. With sourcemaps, the bundle
+// gets an index map with one section per part.
+bool generate_bundle(const FileMapper& filemap, const std::filesystem::path& input_path, const std::filesystem::path& output_path)
+{
+  std::string bundle_type = input_path.stem().extension().string();
+  std::string output, sections;
+  std::size_t line_count = 0;
+  std::vector<std::string> missing;
+  const auto& parts = filemap.get_references(input_path.string());
+  TraceSpan span("bundle", input_path.string());
+
+  if (bundle_type != ".js" && bundle_type != ".css")
+  {
+    job_error() << "[crails-assets] " << input_path.string() << ": bundles must be named *.js.bundle or *.css.bundle" << std::endl;
+    return false;
+  }
+  for (const std::string& alias : parts)
+  {
+    std::string key, filename, contents, url;
+    std::filesystem::path part_path;
+
+    if (!filemap.get_key_from_alias(alias, key) || !public_filename_for(filemap, key, filename))
+    {
+      missing.push_back(alias);
+      continue ;
+    }
+    if (is_bundle(key) || !accepts_part(bundle_type, key))
+    {
+      job_error() << "[crails-assets] " << input_path.string() << ": cannot bundle " << alias << " in a " << bundle_type << " bundle" << std::endl;
+      return false;
+    }
+    part_path = output_path.parent_path() / filename;
+    if (!Crails::read_file(part_path.string(), contents))
+    {
+      job_error() << "[crails-assets] Cannot read `" << part_path.string() << '`' << std::endl;
+      return false;
+    }
+    url = remove_sourcemap_comment(contents);
+    if (contents.length() > 0 && contents.back() != '\n')
+      contents += '\n';
+    if (with_source_maps)
+    {
+      std::string sourcemap = load_part_sourcemap(part_path, url);
+      std::size_t part_lines = std::count(contents.begin(), contents.end(), '\n');
+
+      if (sourcemap.length() == 0)
+        sourcemap = identity_sourcemap('/' + public_scope + filename, part_lines);
+      sections += std::string(sections.length() > 0 ? "," : "")
+        + "{\"offset\":{\"line\":" + std::to_string(line_count) + ",\"column\":0},\"map\":" + sourcemap + '}';
+    }
+    line_count += std::count(contents.begin(), contents.end(), '\n');
+    output += contents;
+  }
+  for (const std::string& alias : missing)
+    job_error() << "[crails-assets] " << input_path.string() << ": asset not found: " << alias << std::endl;
+  if (missing.size() > 0)
+    return false;
+  if (with_source_maps)
+  {
+    std::string map_name = output_path.filename().string() + ".map";
+    std::string sourcemap = "{\"version\":3,\"file\":" + json_string(output_path.filename().string()) + ",\"sections\":[" + sections + "]}";
+
+    if (bundle_type == ".js")
+      output += "//# " + sourcemap_directive + map_name + '\n';
+    else
+      output += "/*# " + sourcemap_directive + map_name + " */\n";
+    if (!Crails::write_file("crails-assets", output_path.string() + ".map", sourcemap))
+      return false;
+  }
+  span.arg("parts", parts.size());
+  span.arg("bytes_written", output.length());
+  if (verbose_mode)
+    job_output() << "[crails-assets] Bundled " << parts.size() << " files from `" << input_path.string() << "` at `" << output_path.string() << '`' << std::endl;
+  return Crails::write_file("crails-assets", output_path.string(), output);
+}
@@ -0,0 +1,16 @@
+#pragma once
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include <vector>
+
+struct FileMapper;
+
+// Bundles are manifests such as `application.js.bundle`, listing the aliases
+// of the scripts or stylesheets to concatenate, one per line. Lines starting
+// with `#` are comments. The bundle is published as `application-<hash>.js`,
+// and its parts are the assets it references, so that its fingerprint
+// changes whenever one of them does.
+bool                     is_bundle(const std::filesystem::path& path);
+std::vector<std::string> find_bundle_parts(std::string_view contents);
+bool                     generate_bundle(const FileMapper& filemap, const std::filesystem::path& input_path, const std::filesystem::path& output_path);
@@ -0,0 +1,115 @@
+#include "compression_policy.hpp"
+#include "mime_type.hpp"
+#include <iomanip>
+#include <sstream>
+
+static const std::vector<std::string> default_excluded_types{
+  "image/png", "image/jpeg", "image/gif", "image/webp", "image/avif",
+  "font/woff", "font/woff2",
+  "audio/*", "video/*",
+  "application/zip", "application/gzip", "application/x-brotli"
+};
+
+std::string compression_name(CompressionStrategy strategy)
+{
+  switch (strategy)
+  {
+  case Gzip:
+    return "gzip";
+  case Brotli:
+    return "brotli";
+  case AllCompressions:
+    return "all";
+  case NoCompression:
+    break ;
+  }
+  return "none";
+}
+
+CompressionPolicy::CompressionPolicy(CompressionStrategy strategy) : excluded_types(default_excluded_types)
+{
+  if (strategy == AllCompressions)
+    strategies = {Gzip, Brotli};
+  else if (strategy != NoCompression)
+    strategies = {strategy};
+  for (CompressionStrategy variant : strategies)
+    statistics[variant];
+}
+
+bool CompressionPolicy::is_excluded(const std::filesystem::path& path) const
+{
+  std::string      extension = path.extension().string();
+  std::string_view mime_type = mime_type_for(path);
+
+  for (const std::string& type : excluded_types)
+  {
+    if (type[0] == '.' ? type == extension : mime_type_matches(type, mime_type))
+      return true;
+  }
+  return false;
+}
+
+bool CompressionPolicy::should_compress(const std::filesystem::path& path, std::uintmax_t size) const
+{
+  return size >= minimum_size && size > 0 && !is_excluded(path);
+}
+
+bool CompressionPolicy::should_keep(std::uintmax_t original_size, std::uintmax_t compressed_size) const
+{
+  return compressed_size < original_size
+      && static_cast<double>(original_size - compressed_size) >= static_cast<double>(original_size) * minimum_savings;
+}
+
+void CompressionPolicy::record_skipped(CompressionStrategy strategy)
+{
+  statistics.at(strategy).skipped++;
+}
+
+void CompressionPolicy::record(CompressionStrategy strategy, std::uintmax_t original_size, std::uintmax_t compressed_size, bool kept)
+{
+  Statistics& stats = statistics.at(strategy);
+
+  if (kept)
+  {
+    stats.kept++;
+    stats.original_bytes += original_size;
+    stats.compressed_bytes += compressed_size;
+  }
+  else
+    stats.discarded++;
+}
+
+void CompressionPolicy::print_summary(std::ostream& stream) const
+{
+  for (const auto& entry : statistics)
+  {
+    const Statistics& stats = entry.second;
+    std::uintmax_t saved = stats.original_bytes - stats.compressed_bytes;
+
+    if (stats.kept + stats.discarded + stats.skipped == 0)
+      continue ;
+    stream << "[crails-assets] " << compression_name(entry.first) << ": "
+           << stats.kept << " variants, " << stats.original_bytes << " -> " << stats.compressed_bytes << " bytes"
+           << " (saved " << saved << " bytes";
+    if (stats.original_bytes > 0)
+      stream << ", " << std::fixed << std::setprecision(1) << (saved * 100.0 / stats.original_bytes) << '%';
+    stream << "), " << stats.discarded << " discarded, " << stats.skipped << " skipped" << std::endl;
+  }
+}
+
+std::string CompressionPolicy::signature() const
+{
+  std::stringstream stream;
+
+  for (CompressionStrategy strategy : strategies)
+    stream << compression_name(strategy) << ',';
+  stream << "gzip-level=" << levels.gzip
+         << ",brotli-level=" << levels.brotli
+         << ",max-effort=" << levels.max_effort
+         << ",min-size=" << minimum_size
+         << ",min-savings=" << minimum_savings
+         << ",exclude=";
+  for (const std::string& type : excluded_types)
+    stream << type << ' ';
+  return stream.str();
+}
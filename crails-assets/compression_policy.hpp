@@ -0,0 +1,43 @@
+#pragma once
+#include "compression.hpp"
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <ostream>
+#include <vector>
+
+// Decides which compressed variants get generated for each public file:
+// excluded types (by extension or MIME type) and files under minimum_size
+// are never compressed, and variants that do not save at least
+// minimum_savings (as a ratio of the original size) are discarded.
+class CompressionPolicy
+{
+public:
+  struct Statistics
+  {
+    std::atomic<std::size_t>    kept{0}, discarded{0}, skipped{0};
+    std::atomic<std::uintmax_t> original_bytes{0}, compressed_bytes{0};
+  };
+
+  CompressionPolicy(CompressionStrategy strategy = Gzip);
+
+  std::vector<CompressionStrategy> strategies;
+  std::vector<std::string>         excluded_types;
+  std::uintmax_t                   minimum_size = 0;
+  double                           minimum_savings = 0.05;
+  CompressionLevels                levels;
+
+  bool        should_compress(const std::filesystem::path& path, std::uintmax_t size) const;
+  bool        should_keep(std::uintmax_t original_size, std::uintmax_t compressed_size) const;
+  void        record_skipped(CompressionStrategy strategy);
+  void        record(CompressionStrategy strategy, std::uintmax_t original_size, std::uintmax_t compressed_size, bool kept);
+  void        print_summary(std::ostream& stream) const;
+  std::string signature() const;
+
+private:
+  bool is_excluded(const std::filesystem::path& path) const;
+
+  std::map<CompressionStrategy, Statistics> statistics;
+};
+
+std::string compression_name(CompressionStrategy strategy);
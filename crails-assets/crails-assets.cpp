@@ -4,16 +4,39 @@
 #include <regex>
 #include <crails/utils/split.hpp>
 #include <cstdlib>
+#include <thread>
+#include <algorithm>
 #include "file_mapper.hpp"
-#include "compression.hpp"
+#include "compression_policy.hpp"
+#include "image_optimizer.hpp"
+#include "responsive_images.hpp"
+#include "digest.hpp"
+#include "build_cache.hpp"
+#include "manifest.hpp"
 #include "exclusion_pattern.hpp"
+#include "glob_pattern.hpp"
+#include "watch.hpp"
+#include "trace.hpp"
 
-bool update_reference_files(const FileMapper& file_map, std::string_view output_path, const ExclusionPattern&);
-bool generate_reference_files(const FileMapper& file_map, std::string_view output_path, const ExclusionPattern&);
-bool generate_public_folder(FileMapper& filemap, const std::string& output_directory, CompressionStrategy strategy, bool verbose);
+bool update_reference_files(const FileMapper& file_map, std::string_view output_path, std::string_view public_directory, const ExclusionPattern&);
+bool generate_reference_files(const FileMapper& file_map, std::string_view output_path, std::string_view public_directory, const ExclusionPattern&);
+bool generate_public_folder(FileMapper& filemap, const std::string& output_directory, CompressionPolicy& compression, ImageOptimizer& images, BuildCache& cache, AssetManifest& manifest, bool verbose);
+bool generate_integrity_file(const FileMapper& file_map, const AssetManifest& manifest, std::string_view output_path, std::string_view public_directory, bool update);
+bool record_generation(const FileMapper& filemap, const std::string& output_directory, bool new_run);
+bool prune_public_folder(const std::string& output_directory, unsigned int kept_generations, const std::string& quarantine);
+std::string sass_implementation();
+std::string minify_implementation();
+
+#ifndef CRAILS_ASSETS_VERSION
+# define CRAILS_ASSETS_VERSION "unknown"
+#endif
 
 bool verbose_mode = false;
 bool with_source_maps = true;
+DigestAlgorithm digest_algorithm = Md5Digest;
+unsigned short checksum_length = 0;
+unsigned int job_count = std::thread::hardware_concurrency();
+bool split_register = false;
 
 static CompressionStrategy get_compression_strategy(const std::string& param)
 {
@@ -28,6 +51,14 @@ static CompressionStrategy get_compression_strategy(const std::string& param)
   return NoCompression;
 }
 
+template<typename FUNCTION>
+static bool trace_phase(const char* name, FUNCTION callback)
+{
+  TraceSpan span("phase", name);
+
+  return callback();
+}
+
 static void extract_alias_from_directory_option(const std::string& option, std::string& directory, std::string& alias)
 {
   unsigned int i = 0;
@@ -57,9 +88,34 @@ int main (int argc, char* argv[])
     ("inputs,i",      boost::program_options::value<std::vector<std::string>>(), "list of input folders. You may prefix each path with an alias, separated by a colon.")
     ("output,o",      boost::program_options::value<std::string>(), "output folder")
     ("compression,c", boost::program_options::value<std::string>(), "gzip, brotli, all or none; defaults to gzip")
+    ("gzip-level",    boost::program_options::value<int>(),         "gzip compression level, from 1 to 9; defaults to 6")
+    ("brotli-level",  boost::program_options::value<int>(),         "brotli compression quality, from 0 to 11; defaults to 11")
+    ("max-compression", "spend as much time as needed to produce the smallest compressed variants (for release builds)")
+    ("compression-exclude", boost::program_options::value<std::vector<std::string>>()->multitoken(), "extensions (.png) or MIME types (image/*) that never get compressed; replaces the default list of already compressed types")
+    ("compression-min-size", boost::program_options::value<std::uintmax_t>(), "files smaller than this size, in bytes, do not get compressed")
+    ("compression-min-savings", boost::program_options::value<double>(), "compressed variants saving less than this ratio of the original size are discarded; defaults to 0.05")
+    ("optimize-images", "recompress PNG, JPEG and SVG images losslessly, using oxipng or optipng, jpegtran and svgo")
+    ("responsive-images", boost::program_options::value<std::vector<std::string>>()->multitoken(), "generate resized variants of the PNG and JPEG images from these directories of the aliases (ex: images/), with srcset constants in the register")
+    ("responsive-widths", boost::program_options::value<std::vector<unsigned int>>()->multitoken(), "widths of the responsive image variants; defaults to 480 960 1920")
+    ("responsive-formats", boost::program_options::value<std::vector<std::string>>()->multitoken(), "webp and/or avif: formats of the responsive image variants, when their encoder is installed; defaults to both")
+    ("include",       boost::program_options::value<std::vector<std::string>>()->multitoken(), "only collect files matching one of these glob patterns")
+    ("exclude",       boost::program_options::value<std::vector<std::string>>()->multitoken(), "ignore files and directories matching these glob patterns (ex: node_modules *.psd)")
+    ("ignore-file",   boost::program_options::value<std::string>(), "file listing glob patterns to exclude, one per line (prefix a line with `include ` to include a pattern instead)")
     ("ifndef",        boost::program_options::value<std::string>(), "exclude some assets from a C++ build based on a define (ex: --ifndef __CHEERP_CLIENT__:application.js:application.js.map)")
     ("sourcemaps,d",  boost::program_options::value<bool>(),        "generates sourcemaps (true by default)")
+    ("digest",        boost::program_options::value<std::string>(), "md5, xxh64 or blake2; defaults to md5")
+    ("checksum-length", boost::program_options::value<unsigned short>(), "number of digest characters appended to public filenames (defaults to the full digest)")
+    ("jobs,j",        boost::program_options::value<unsigned int>(), "number of parallel jobs (defaults to the number of cores)")
+    ("no-cache", "do not read or write the build cache")
+    ("manifest",      "write manifest.json in the output folder, describing the public path, integrity, sizes and type of each asset")
+    ("binary-manifest", "also write the manifest in a compact binary format, in manifest.bin")
+    ("prune",         "remove the files of the output folder that were not produced by the last runs")
+    ("prune-keep",    boost::program_options::value<unsigned int>(), "number of runs whose files are kept by --prune, for rolling deploys; defaults to 3")
+    ("prune-quarantine", boost::program_options::value<std::string>(), "move the files removed by --prune to this folder instead of deleting them")
+    ("split-register", "generate one register header per asset directory (ex: assets/images.hpp), with constexpr values")
+    ("watch,w",       "keep running, and generate the assets again whenever the input folders change")
     ("update,u", "append or update to the existing asset register instead of generating a new register")
+    ("trace",         boost::program_options::value<std::string>(), "write a trace of the build to this file, in the Chrome trace event format (see chrome://tracing or ui.perfetto.dev), and display the slowest stages and assets")
     ("verbose,v", "enable verbose mode")
     ("help,h", "display help message");
   boost::program_options::store(boost::program_options::parse_command_line(argc, argv, desc), options);
@@ -72,16 +128,91 @@ int main (int argc, char* argv[])
   verbose_mode = options.count("verbose");
   if (options.count("inputs") && options.count("output"))
   {
-    std::string pattern(".*");
+    PathFilter  filter;
     auto        directory_options = options["inputs"].as<std::vector<std::string>>();
     std::string output = options["output"].as<std::string>();
-    CompressionStrategy compression = options.count("compression") ? get_compression_strategy(options["compression"].as<std::string>()) : Gzip;
+    CompressionPolicy compression(options.count("compression") ? get_compression_strategy(options["compression"].as<std::string>()) : Gzip);
+    ImageOptimizer images;
     ExclusionPattern exclusion_pattern;
+    BuildCache cache;
+    AssetManifest manifest;
+    std::vector<WatchedDirectory> watched_directories;
 
+    split_register = options.count("split-register");
+    // The headers of a split register aren't parsed back: they would only
+    // list the assets of the current run, and remove those of other runs.
+    if (split_register && options.count("update"))
+    {
+      std::cerr << "[crails-assets] --split-register cannot be combined with --update" << std::endl;
+      return -1;
+    }
+    if (options.count("trace"))
+      build_trace.enable(options["trace"].as<std::string>());
+    manifest.binary = options.count("binary-manifest");
+    manifest.enabled = manifest.binary || options.count("manifest");
     if (options.count("sourcemaps"))
       with_source_maps = options["sourcemaps"].as<bool>();
+    if (options.count("digest") && !get_digest_algorithm(options["digest"].as<std::string>(), digest_algorithm))
+    {
+      std::cerr << "Unrecognized digest algorithm `" << options["digest"].as<std::string>() << '`' << std::endl;
+      return -1;
+    }
+    if (options.count("checksum-length"))
+      checksum_length = options["checksum-length"].as<unsigned short>();
+    if (options.count("jobs"))
+      job_count = options["jobs"].as<unsigned int>();
+    if (options.count("gzip-level"))
+      compression.levels.gzip = std::clamp(options["gzip-level"].as<int>(), 1, 9);
+    if (options.count("brotli-level"))
+      compression.levels.brotli = std::clamp(options["brotli-level"].as<int>(), 0, 11);
+    compression.levels.max_effort = options.count("max-compression");
+    if (options.count("compression-exclude"))
+      compression.excluded_types = options["compression-exclude"].as<std::vector<std::string>>();
+    if (options.count("compression-min-size"))
+      compression.minimum_size = options["compression-min-size"].as<std::uintmax_t>();
+    if (options.count("compression-min-savings"))
+      compression.minimum_savings = options["compression-min-savings"].as<double>();
+    images.enabled = options.count("optimize-images");
+    images.cache_directory = output + "/.crails-assets.images";
+    if (images.enabled && images.signature().length() == 0)
+      std::cerr << "[crails-assets] no image optimizer found: install oxipng or optipng, jpegtran or svgo" << std::endl;
+    if (options.count("responsive-images"))
+      responsive_images.directories = options["responsive-images"].as<std::vector<std::string>>();
+    if (options.count("responsive-widths"))
+      responsive_images.widths = options["responsive-widths"].as<std::vector<unsigned int>>();
+    if (options.count("responsive-formats"))
+      responsive_images.formats = options["responsive-formats"].as<std::vector<std::string>>();
+    if (!responsive_images.configure())
+      return -1;
+    if (options.count("ignore-file") && !filter.load(options["ignore-file"].as<std::string>()))
+      return -1;
+    if (options.count("include"))
+    {
+      for (const std::string& pattern : options["include"].as<std::vector<std::string>>())
+        filter.includes.emplace_back(pattern);
+    }
+    if (options.count("exclude"))
+    {
+      for (const std::string& pattern : options["exclude"].as<std::vector<std::string>>())
+        filter.excludes.emplace_back(pattern);
+    }
     if (options.count("ifndef"))
       exclusion_pattern = ExclusionPattern(options["ifndef"].as<string>());
+    if (!options.count("no-cache"))
+    {
+      std::stringstream build_signature;
+
+      build_signature << CRAILS_ASSETS_VERSION
+        << ";compression=" << compression.signature()
+        << ";images=" << images.signature()
+        << ";sourcemaps=" << with_source_maps
+        << ";checksum-length=" << checksum_length
+        << ";sass=" << sass_implementation()
+        << ";minifier=" << minify_implementation();
+      cache = BuildCache(output + "/.crails-assets.cache", std::to_string(digest_algorithm), build_signature.str());
+      if (cache.load() && verbose_mode)
+        std::cout << "[crails-assets] loaded build cache with " << cache.size() << " entries" << std::endl;
+    }
     for (const std::string& directory_option : directory_options)
     {
       std::string alias;
@@ -90,26 +221,85 @@ int main (int argc, char* argv[])
       extract_alias_from_directory_option(directory_option, directory, alias);
       if (verbose_mode)
         std::cout << "[crails-assets] collecting files from directory: " << directory << std::endl;
-      if (files.collect_files(std::filesystem::path(directory), alias, pattern))
-        continue ;
+      if (trace_phase("collect files", [&]() { return files.collect_files(std::filesystem::path(directory), alias, filter); }))
+        watched_directories.push_back({directory, alias});
       else
         return -1;
     }
-    if (verbose_mode)
-      std::cout << "[crails-assets] outputing files to " << output << std::endl;
-    if (generate_public_folder(files, output, compression, verbose_mode))
+    bool first_build = true;
+    auto generate = [&]()
     {
-      bool success;
+      bool generated;
       const char* autogen_folder_var = std::getenv("CRAILS_AUTOGEN_DIR");
       string autogen_folder = autogen_folder_var ? autogen_folder_var : "app/autogen";
 
+      if (verbose_mode)
+        std::cout << "[crails-assets] generating checksums" << std::endl;
+      if (!trace_phase("checksums", [&]() { return files.generate_checksums(cache); }))
+        return false;
+      trace_phase("fingerprints", [&]() { files.generate_fingerprints(); return true; });
+      if (verbose_mode)
+        std::cout << "[crails-assets] outputing files to " << output << std::endl;
+      generated = trace_phase("public folder", [&]() { return generate_public_folder(files, output, compression, images, cache, manifest, verbose_mode); });
+      // The manifest entries completed from the public folder are stored in the build cache
+      if (generated && manifest.enabled)
+        generated = trace_phase("manifest", [&]() { return manifest.complete(files, output, cache); });
+      trace_phase("build cache", [&]() { return cache.save(); });
+      if (generated)
+      {
+        generated = trace_phase("generation", [&]() { return record_generation(files, output, first_build); });
+        first_build = false;
+      }
+      if (generated && options.count("prune"))
+      {
+        generated = trace_phase("prune", [&]()
+        {
+          return prune_public_folder(
+            output,
+            options.count("prune-keep") ? options["prune-keep"].as<unsigned int>() : 3,
+            options.count("prune-quarantine") ? options["prune-quarantine"].as<std::string>() : std::string()
+          );
+        });
+      }
+      if (generated && manifest.enabled)
+      {
+        generated = trace_phase("manifest files", [&]()
+        {
+          return manifest.save(files, output)
+            && generate_integrity_file(files, manifest, autogen_folder, output, options.count("update"));
+        });
+      }
+      if (!generated)
+        return false;
       if (verbose_mode)
         std::cout << "[crails-assets] outputing reference files to " << autogen_folder << std::endl;
-      success = options.count("update")
-        ? update_reference_files(files, autogen_folder, exclusion_pattern)
-        : generate_reference_files(files, autogen_folder, exclusion_pattern);
-      return success ? 0 : -1;
+      return trace_phase("register", [&]()
+      {
+        return options.count("update")
+          ? update_reference_files(files, autogen_folder, output, exclusion_pattern)
+          : generate_reference_files(files, autogen_folder, output, exclusion_pattern);
+      });
+    };
+    auto build = [&]()
+    {
+      bool success = trace_phase("build", generate);
+
+      if (build_trace.is_enabled())
+      {
+        build_trace.print_summary(std::cout);
+        if (!build_trace.save())
+          return false;
+      }
+      return success;
+    };
+
+    if (options.count("watch"))
+    {
+      build();
+      // Each rebuild gets its own trace, which replaces the previous one
+      return watch_assets(files, watched_directories, filter, [&]() { build_trace.reset(); return build(); });
     }
+    return build() ? 0 : -1;
   }
   else
     std::cerr << "inputs and output arguments are required" << std::endl;
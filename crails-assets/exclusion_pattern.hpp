@@ -30,6 +30,11 @@ public:
     return std::find(files.begin(), files.end(), file) != files.end();
   }
 
+  std::string define_for(const std::string& file) const
+  {
+    return matches(file) ? define : std::string();
+  }
+
   void protect(const std::string& file, std::stringstream& stream, std::function<void()> callback) const
   {
     if (matches(file))
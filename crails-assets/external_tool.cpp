@@ -0,0 +1,45 @@
+#include <crails/cli/process.hpp>
+#include "external_tool.hpp"
+
+ExternalTool find_external_tool(const std::vector<std::string>& candidates)
+{
+  for (const std::string& candidate : candidates)
+  {
+    std::string path = Crails::which(candidate);
+
+    if (path.length() > 0)
+      return ExternalTool{candidate, path};
+  }
+  return ExternalTool();
+}
+
+std::map<std::string, ExternalTool> find_external_tools(const std::map<std::string, std::vector<std::string>>& candidates)
+{
+  std::map<std::string, ExternalTool> result;
+
+  for (const auto& group : candidates)
+  {
+    ExternalTool tool = find_external_tool(group.second);
+
+    if (tool.path.length() > 0)
+      result.emplace(group.first, tool);
+  }
+  return result;
+}
+
+// Replaced values are skipped, so that they never get substituted themselves
+std::string replace_variables(std::string command, const std::map<std::string, std::string>& variables)
+{
+  for (const auto& variable : variables)
+  {
+    std::string pattern = '$' + variable.first;
+    std::size_t position = 0;
+
+    while ((position = command.find(pattern, position)) != std::string::npos)
+    {
+      command.replace(position, pattern.length(), variable.second);
+      position += variable.second.length();
+    }
+  }
+  return command;
+}
@@ -0,0 +1,20 @@
+#pragma once
+#include <map>
+#include <string>
+#include <vector>
+
+struct ExternalTool
+{
+  std::string name, path;
+};
+
+// Picks the first candidate installed on the system. The name and path are
+// left empty when none of the candidates is found.
+ExternalTool find_external_tool(const std::vector<std::string>& candidates);
+
+// Picks a tool for each group of candidates. Groups without any installed
+// candidate are left out.
+std::map<std::string, ExternalTool> find_external_tools(const std::map<std::string, std::vector<std::string>>& candidates);
+
+// Replaces each `$name` of a command template with the value of `name`
+std::string replace_variables(std::string command, const std::map<std::string, std::string>& variables);
@@ -1,78 +1,284 @@
 #include "file_mapper.hpp"
-#include <crails/cli/process.hpp>
-#include <sstream>
-#include <regex>
-#include <cstring>
+#include "digest.hpp"
+#include "build_cache.hpp"
+#include "glob_pattern.hpp"
+#include "mapped_file.hpp"
+#include "asset_path_scanner.hpp"
+#include "bundle.hpp"
+#include "trace.hpp"
+#include <sys/stat.h>
+#include <chrono>
+#include <set>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
 #include <iostream>
 
+extern bool verbose_mode;
+extern DigestAlgorithm digest_algorithm;
+extern unsigned int job_count;
+
 bool FileMapper::get_key_from_alias(const std::string& alias, std::string& key) const
 {
-  for (auto it = aliases.begin() ; it != aliases.end() ; ++it)
+  auto it = keys_by_alias.find(alias);
+
+  if (it != keys_by_alias.end())
   {
-    if (it->second == alias)
-    {
-      key = it->first;
-      return true;
-    }
+    key = it->second;
+    return true;
   }
   return false;
 }
 
-bool FileMapper::collect_file(std::filesystem::path root, std::filesystem::path filepath, const std::string& scope, const std::string& pattern)
+void FileMapper::set_alias(const std::string& key, std::filesystem::path directory, const std::string& scope)
+{
+  const std::string& container = directory.string();
+  auto alias = aliases.emplace(key, scope + key.substr(container.length() + 1));
+
+  if (alias.second)
+    keys_by_alias.emplace(alias.first->second, key);
+}
+
+FileMapper::iterator FileMapper::erase(iterator it)
 {
-  std::regex matcher(pattern.c_str());
-  std::string filename = filepath.filename().string();
-  auto match = std::sregex_iterator(filename.begin(), filename.end(), matcher);
+  auto alias = aliases.find(it->first);
 
-  if (std::filesystem::is_directory(filepath))
+  if (alias != aliases.end())
   {
-    if (collect_files(root, filepath, scope, pattern))
-      return true;
+    auto key = keys_by_alias.find(alias->second);
+
+    // Another asset may share this alias, and own its entry
+    if (key != keys_by_alias.end() && key->second == it->first)
+      keys_by_alias.erase(key);
+    aliases.erase(alias);
+  }
+  references.erase(it->first);
+  checksums.erase(it->first);
+  return std::map<std::string, std::string>::erase(it);
+}
+
+// Invalidated assets get their checksum computed again by the next call to
+// generate_checksums.
+void FileMapper::invalidate(const std::string& key)
+{
+  auto it = find(key);
+
+  if (it != end())
+    it->second.clear();
+  checksums.erase(key);
+}
+
+const std::vector<std::string>& FileMapper::get_references(const std::string& key) const
+{
+  static const std::vector<std::string> no_references;
+  auto it = references.find(key);
+
+  return it != references.end() ? it->second : no_references;
+}
+
+void FileMapper::collect_file(const std::filesystem::path& root, const std::filesystem::path& filepath, const std::string& scope)
+{
+  if (emplace(filepath.string(), std::string()).second)
+    set_alias(filepath.string(), root, scope);
+}
+
+// Each directory inode is only visited once, which prevents symlink loops and
+// duplicate traversals. Symlinks to directories are only followed when they
+// point outside of the scanned directory: otherwise, they would only produce
+// duplicates, with aliases depending on the order in which entries are listed.
+static bool visit_directory(const std::filesystem::path& path, std::set<std::pair<dev_t, ino_t>>& visited_directories)
+{
+  struct stat info;
+
+  if (stat(path.c_str(), &info) != 0)
     return false;
+  return visited_directories.emplace(info.st_dev, info.st_ino).second;
+}
+
+bool FileMapper::collect_files(const std::filesystem::path& directory, const std::string& scope, const PathFilter& filter)
+{
+  auto                                start = std::chrono::steady_clock::now();
+  std::filesystem::path               canonical_root = std::filesystem::weakly_canonical(directory);
+  std::set<std::pair<dev_t, ino_t>>   visited_directories;
+  std::filesystem::recursive_directory_iterator it, end;
+  std::size_t                         entry_count = 0;
+  std::error_code                     error;
+
+  if (std::filesystem::is_regular_file(directory))
+  {
+    if (filter.accepts_file(directory.filename()))
+      collect_file(directory.parent_path(), directory, scope);
+    return true;
+  }
+  else if (!std::filesystem::is_directory(directory))
+    return true;
+  visit_directory(directory, visited_directories);
+  it = std::filesystem::recursive_directory_iterator(directory, std::filesystem::directory_options::follow_directory_symlink, error);
+  for (; !error && it != end ; it.increment(error))
+  {
+    const std::filesystem::directory_entry& entry = *it;
+    std::filesystem::path relative_path = entry.path().lexically_relative(directory);
+    std::error_code type_error;
+
+    entry_count++;
+    if (entry.is_directory(type_error))
+    {
+      bool follow = !filter.is_excluded_directory(relative_path);
+
+      if (follow && entry.is_symlink(type_error))
+      {
+        auto target = std::filesystem::weakly_canonical(entry.path(), type_error).lexically_relative(canonical_root);
+
+        follow = !type_error && (target.empty() || *target.begin() == "..");
+      }
+      if (!follow || !visit_directory(entry.path(), visited_directories))
+        it.disable_recursion_pending();
+    }
+    else if (entry.is_regular_file(type_error) && filter.accepts_file(relative_path))
+      collect_file(directory, entry.path(), scope);
+  }
+  if (error)
+  {
+    std::cerr << "[crails-assets] cannot scan " << directory << ": " << error.message() << std::endl;
+    return false;
+  }
+  if (verbose_mode)
+  {
+    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+
+    std::cout << "[crails-assets] scanned " << entry_count << " entries in " << directory << " (" << duration.count() << "ms)" << std::endl;
   }
-  else if (match != std::sregex_iterator())
-    return generate_checksum(root, filepath, scope);
   return true;
 }
 
-bool FileMapper::collect_files(std::filesystem::path root, std::filesystem::path directory, const std::string& scope, const std::string& pattern)
+bool FileMapper::generate_checksums(BuildCache& cache)
 {
-  if (std::filesystem::is_directory(directory))
+  std::vector<iterator>    pending;
+  std::vector<FileStat>    stats;
+  std::vector<std::vector<std::string>> file_references;
+  std::vector<std::string> failures;
+  std::vector<std::thread> workers;
+  std::atomic<std::size_t> next_file(0);
+  std::mutex               failures_mutex;
+  unsigned int             worker_count = std::max(1u, job_count);
+  auto                     worker = [&]()
   {
-    std::filesystem::recursive_directory_iterator dir(directory);
+    for (std::size_t i = next_file++ ; i < pending.size() ; i = next_file++)
+    {
+      const std::string& source = pending[i]->first;
+      bool stat_success = stat_file(source, stats[i]);
+      TraceSpan span("checksum", source);
+
+      if (stat_success && cache.find_digest(source, stats[i], pending[i]->second, file_references[i]))
+      {
+        span.arg("cache", "hit");
+        continue ;
+      }
+      span.arg("cache", "miss");
+      if (stat_success)
+      {
+        MappedFile file(source);
+
+        if (file.is_open())
+        {
+          span.arg("bytes_read", file.size());
+          pending[i]->second = digest(digest_algorithm, file.data());
+          if (may_reference_assets(source))
+            file_references[i] = find_asset_references(source, aliases.at(source), file.data());
+          else if (is_bundle(source))
+            file_references[i] = find_bundle_parts(file.data());
+        }
+      }
+      if (pending[i]->second.length() == 0)
+      {
+        std::lock_guard<std::mutex> lock(failures_mutex);
+        failures.push_back(pending[i]->first);
+      }
+    }
+  };
 
-    for (auto& entry : dir)
+  for (auto it = begin() ; it != end() ; ++it)
+  {
+    if (it->second.length() == 0)
+      pending.push_back(it);
+  }
+  stats.resize(pending.size());
+  file_references.resize(pending.size());
+  worker_count = std::min<unsigned int>(worker_count, pending.size());
+  for (unsigned int i = 1 ; i < worker_count ; ++i)
+    workers.emplace_back(worker);
+  worker();
+  for (auto& thread : workers)
+    thread.join();
+  for (std::size_t i = 0 ; i < pending.size() ; ++i)
+  {
+    if (pending[i]->second.length() > 0)
     {
-      if (!collect_file(root, entry.path(), scope, pattern))
-        return false;
+      cache.store_digest(pending[i]->first, stats[i], pending[i]->second, file_references[i]);
+      checksums[pending[i]->first] = pending[i]->second;
+      if (file_references[i].size() > 0)
+        references[pending[i]->first] = std::move(file_references[i]);
+      else
+        references.erase(pending[i]->first);
     }
   }
-  else if (std::filesystem::is_regular_file(directory))
+  for (auto it = cache.begin() ; it != cache.end() ;)
+    it = find(it->first) == end() ? cache.erase(it) : std::next(it);
+  std::sort(failures.begin(), failures.end());
+  for (const std::string& failure : failures)
+    std::cerr << "Failed to generate checksum for " << failure << std::endl;
+  return failures.size() == 0;
+}
+
+void FileMapper::generate_fingerprints()
+{
+  std::unordered_map<std::string, VisitState> states;
+
+  for (auto it = begin() ; it != end() ; ++it)
   {
-    if (root == directory)
-      root = directory.parent_path();
-    if (!collect_file(root, directory, scope, pattern))
-      return false;
+    if (states[it->first] == Unvisited)
+      generate_fingerprint(it, states);
   }
-  return true;
 }
 
-bool FileMapper::generate_checksum(const std::filesystem::path& root, const std::filesystem::path& source, const std::string& scope)
+// Dependencies are fingerprinted first (depth-first, in topological order).
+// Within a reference cycle, the dependency closing the cycle contributes its
+// own checksum instead of its fingerprint.
+void FileMapper::generate_fingerprint(iterator it, std::unordered_map<std::string, VisitState>& states)
 {
-  std::string line;
-  char        sum[32];
+  std::vector<std::string> dependencies;
 
-  Crails::run_command({"md5sum", {source.string()}}, line);
-  if (line.length() > 32)
+  states[it->first] = Visiting;
+  for (const std::string& alias : get_references(it->first))
   {
-    std::strncpy(sum, line.c_str(), 32);
-    emplace(source.string(), std::string(sum, 32));
-    set_alias(source.string(), root, scope);
+    std::string key;
+    iterator    dependency;
+
+    if (!get_key_from_alias(alias, key) || key == it->first || (dependency = find(key)) == end())
+      continue ;
+    if (states[key] == Unvisited)
+      generate_fingerprint(dependency, states);
+    else if (states[key] == Visiting)
+    {
+      // Its fingerprint isn't known yet: in watch mode, it still holds the
+      // fingerprint from the previous build.
+      if (verbose_mode)
+        std::cout << "[crails-assets] circular reference between " << it->first << " and " << key << std::endl;
+      dependencies.push_back(alias + ':' + checksums.at(key));
+      continue ;
+    }
+    dependencies.push_back(alias + ':' + dependency->second);
   }
-  else
+  it->second = checksums.at(it->first);
+  if (dependencies.size() > 0)
   {
-    std::cerr << "Failed to generate checksum for " << source.string() << std::endl;
-    return false;
+    std::string input = it->second;
+
+    for (const std::string& dependency : dependencies)
+      input += '\n' + dependency;
+    it->second = digest(digest_algorithm, input);
   }
-  return true;
+  states[it->first] = Visited;
 }
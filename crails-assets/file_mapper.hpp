@@ -1,24 +1,41 @@
 #pragma once
 #include <map>
+#include <unordered_map>
+#include <vector>
 #include <string>
 #include <filesystem>
 
+class BuildCache;
+class PathFilter;
+
+// Maps the path of each asset to its fingerprint. Aliases are indexed both
+// ways, and erasing an asset also removes its alias from the indexes.
+//
+// Fingerprints are computed from the checksum of each asset, and from the
+// fingerprints of the assets it references, so that an asset gets a new
+// public path whenever one of its dependencies does. The checksums are kept
+// apart from the fingerprints, so that fingerprints can be generated again
+// after some assets are invalidated (see --watch).
 struct FileMapper : public std::map<std::string, std::string>
 {
-  std::map<std::string, std::string> aliases;
-
   bool               get_key_from_alias(const std::string& alias, std::string& key) const;
   const std::string& get_alias(const std::string& key) const { return aliases.at(key); }
-  void               set_alias(const std::string& key, std::filesystem::path directory, const std::string& scope)
-  {
-    const std::string& container = directory.string();
-
-    aliases.emplace(key, scope + key.substr(container.length() + 1));
-  }
+  void               set_alias(const std::string& key, std::filesystem::path directory, const std::string& scope);
+  iterator           erase(iterator it);
+  void               invalidate(const std::string& key);
+  const std::vector<std::string>& get_references(const std::string& key) const;
 
-  bool        collect_files(std::filesystem::path directory, const std::string& scope, const std::string& pattern) { return collect_files(directory, directory, scope, pattern); }
+  bool        collect_files(const std::filesystem::path& directory, const std::string& scope, const PathFilter& filter);
+  void        collect_file(const std::filesystem::path& root, const std::filesystem::path& filepath, const std::string& scope);
+  bool        generate_checksums(BuildCache& cache);
+  void        generate_fingerprints();
 protected:
-  bool        collect_files(std::filesystem::path root, std::filesystem::path directory, const std::string& scope, const std::string& pattern);
-  bool        collect_file(std::filesystem::path root, std::filesystem::path filepath, const std::string& scope, const std::string& pattern);
-  bool        generate_checksum(const std::filesystem::path& root, const std::filesystem::path& source, const std::string& scope);
+  enum VisitState { Unvisited, Visiting, Visited };
+
+  void        generate_fingerprint(iterator it, std::unordered_map<std::string, VisitState>& states);
+
+  std::unordered_map<std::string, std::string> aliases;
+  std::unordered_map<std::string, std::string> keys_by_alias;
+  std::unordered_map<std::string, std::vector<std::string>> references;
+  std::unordered_map<std::string, std::string> checksums;
 };
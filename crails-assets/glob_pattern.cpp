@@ -0,0 +1,196 @@
+#include "glob_pattern.hpp"
+#include <cctype>
+#include <fstream>
+#include <iostream>
+
+static bool matches_class(std::string_view pattern, std::size_t& index, char c)
+{
+  bool negate = false;
+  bool matched = false;
+  std::size_t i = index + 1;
+
+  if (i < pattern.length() && (pattern[i] == '!' || pattern[i] == '^'))
+  {
+    negate = true;
+    ++i;
+  }
+  for (std::size_t first = i ; i < pattern.length() && (pattern[i] != ']' || i == first) ; ++i)
+  {
+    if (i + 2 < pattern.length() && pattern[i + 1] == '-' && pattern[i + 2] != ']')
+    {
+      matched = matched || (c >= pattern[i] && c <= pattern[i + 2]);
+      i += 2;
+    }
+    else
+      matched = matched || c == pattern[i];
+  }
+  index = i;
+  return matched != negate;
+}
+
+static bool matches_segment(std::string_view pattern, std::string_view name)
+{
+  std::size_t p = 0, n = 0;
+  std::size_t star_p = std::string_view::npos, star_n = 0;
+
+  while (n < name.length())
+  {
+    if (p < pattern.length() && pattern[p] == '*')
+    {
+      star_p = p++;
+      star_n = n;
+      continue ;
+    }
+    if (p < pattern.length())
+    {
+      std::size_t next_p = p;
+      bool matched;
+
+      if (pattern[p] == '?')
+        matched = true;
+      else if (pattern[p] == '[' && pattern.find(']', p + 2) != std::string_view::npos)
+        matched = matches_class(pattern, next_p, name[n]);
+      else
+        matched = pattern[p] == name[n];
+      if (matched)
+      {
+        p = next_p + 1;
+        ++n;
+        continue ;
+      }
+    }
+    if (star_p == std::string_view::npos)
+      return false;
+    p = star_p + 1;
+    n = ++star_n;
+  }
+  while (p < pattern.length() && pattern[p] == '*')
+    ++p;
+  return p == pattern.length();
+}
+
+GlobPattern::GlobPattern(const std::string& pattern) : source(pattern)
+{
+  std::string_view view(pattern);
+
+  if (view.length() > 1 && view.back() == '/')
+  {
+    directory_only = true;
+    view.remove_suffix(1);
+  }
+  if (view.length() > 0 && view.front() == '/')
+  {
+    anchored = true;
+    view.remove_prefix(1);
+  }
+  anchored = anchored || view.find('/') != std::string_view::npos;
+  while (view.length() > 0)
+  {
+    std::size_t separator = view.find('/');
+
+    segments.emplace_back(view.substr(0, separator));
+    view.remove_prefix(separator == std::string_view::npos ? view.length() : separator + 1);
+  }
+}
+
+bool GlobPattern::matches_from(const std::vector<std::string_view>& path, std::size_t path_index, std::size_t pattern_index) const
+{
+  for (; pattern_index < segments.size() ; ++pattern_index, ++path_index)
+  {
+    if (segments[pattern_index] == "**")
+    {
+      for (std::size_t i = path_index ; i <= path.size() ; ++i)
+      {
+        if (matches_from(path, i, pattern_index + 1))
+          return true;
+      }
+      return false;
+    }
+    if (path_index >= path.size() || !matches_segment(segments[pattern_index], path[path_index]))
+      return false;
+  }
+  return path_index == path.size();
+}
+
+bool GlobPattern::matches(const std::vector<std::string_view>& path, bool is_directory) const
+{
+  if (path.size() == 0 || (directory_only && !is_directory))
+    return false;
+  if (anchored)
+    return matches_from(path, 0, 0);
+  return segments.size() == 1 && matches_segment(segments.front(), path.back());
+}
+
+static std::vector<std::string_view> path_segments(const std::string& path)
+{
+  std::vector<std::string_view> result;
+  std::string_view view(path);
+
+  while (view.length() > 0)
+  {
+    std::size_t separator = view.find('/');
+
+    if (separator != 0)
+      result.push_back(view.substr(0, separator));
+    view.remove_prefix(separator == std::string_view::npos ? view.length() : separator + 1);
+  }
+  return result;
+}
+
+// Each line of an ignore file is a pattern, excluded by default. Lines
+// may be prefixed with `include ` or `exclude `; empty lines and lines
+// starting with `#` are ignored.
+bool PathFilter::load(const std::filesystem::path& path)
+{
+  std::ifstream stream(path);
+  std::string line;
+
+  if (!stream.is_open())
+  {
+    std::cerr << "[crails-assets] cannot open ignore file " << path << std::endl;
+    return false;
+  }
+  while (std::getline(stream, line))
+  {
+    while (line.length() > 0 && std::isspace(line.back()))
+      line.pop_back();
+    if (line.length() == 0 || line[0] == '#')
+      continue ;
+    if (line.substr(0, 8) == "include ")
+      includes.emplace_back(line.substr(8));
+    else if (line.substr(0, 8) == "exclude ")
+      excludes.emplace_back(line.substr(8));
+    else
+      excludes.emplace_back(line);
+  }
+  return true;
+}
+
+bool PathFilter::is_excluded_directory(const std::filesystem::path& relative_path) const
+{
+  std::string path = relative_path.generic_string();
+  auto segments = path_segments(path);
+
+  for (const GlobPattern& pattern : excludes)
+  {
+    if (pattern.matches(segments, true))
+      return true;
+  }
+  return false;
+}
+
+bool PathFilter::accepts_file(const std::filesystem::path& relative_path) const
+{
+  std::string path = relative_path.generic_string();
+  auto segments = path_segments(path);
+  bool included = includes.size() == 0;
+
+  for (const GlobPattern& pattern : excludes)
+  {
+    if (pattern.matches(segments, false))
+      return false;
+  }
+  for (auto it = includes.begin() ; !included && it != includes.end() ; ++it)
+    included = it->matches(segments, false);
+  return included;
+}
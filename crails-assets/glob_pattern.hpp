@@ -0,0 +1,41 @@
+#pragma once
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Shell-like wildcard patterns, compiled once and matched against paths
+// relative to an input directory. Supports `*`, `?`, `[a-z]`, `[!a-z]` and
+// `**` (any number of directories).
+//
+// Patterns without any slash apply to the name of each file or directory
+// (`node_modules`, `*.psd`), while other patterns are anchored to the
+// input directory (`images/raw/**`). A trailing slash restricts a pattern
+// to directories.
+class GlobPattern
+{
+public:
+  GlobPattern(const std::string& pattern);
+
+  bool matches(const std::vector<std::string_view>& path_segments, bool is_directory) const;
+  const std::string& str() const { return source; }
+
+private:
+  bool matches_from(const std::vector<std::string_view>& path, std::size_t path_index, std::size_t pattern_index) const;
+
+  std::string              source;
+  std::vector<std::string> segments;
+  bool                     anchored = false;
+  bool                     directory_only = false;
+};
+
+class PathFilter
+{
+public:
+  std::vector<GlobPattern> includes;
+  std::vector<GlobPattern> excludes;
+
+  bool load(const std::filesystem::path& path);
+  bool is_excluded_directory(const std::filesystem::path& relative_path) const;
+  bool accepts_file(const std::filesystem::path& relative_path) const;
+};
@@ -0,0 +1,212 @@
+#include <crails/cli/process.hpp>
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <unordered_set>
+#include <vector>
+#include "image_optimizer.hpp"
+#include "file_mapper.hpp"
+#include "job_scheduler.hpp"
+#include "trace.hpp"
+#include "external_tool.hpp"
+
+extern bool verbose_mode;
+
+static const std::map<std::string, std::vector<std::string>> image_tool_candidates{
+  {"png",  {"oxipng", "optipng"}},
+  {"jpeg", {"jpegtran"}},
+  {"svg",  {"svgo"}}
+};
+static const std::map<std::string, std::string> image_tool_options{
+  {"oxipng",   "--quiet --opt 2 --strip safe --out \"$output\" \"$input\""},
+  {"optipng",  "-quiet -o2 -clobber -out \"$output\" \"$input\""},
+  {"jpegtran", "-copy all -optimize -progressive -outfile \"$output\" \"$input\""},
+  {"svgo",     "--quiet --input \"$input\" --output \"$output\""}
+};
+
+static std::string image_type(const std::filesystem::path& path)
+{
+  std::string extension = path.extension().string();
+
+  std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+  if (extension == ".png")
+    return "png";
+  if (extension == ".jpg" || extension == ".jpeg")
+    return "jpeg";
+  if (extension == ".svg")
+    return "svg";
+  return "";
+}
+
+// The tools are only looked up once per run
+static const std::map<std::string, ExternalTool>& image_tools()
+{
+  static const std::map<std::string, ExternalTool> tools = find_external_tools(image_tool_candidates);
+
+  return tools;
+}
+
+static std::string image_command(const ExternalTool& tool, const std::filesystem::path& input_path, const std::filesystem::path& output_path)
+{
+  return '"' + tool.path + "\" " + replace_variables(image_tool_options.at(tool.name), {{"input", input_path.string()}, {"output", output_path.string()}});
+}
+
+// Cached images are named after the tool which optimized them, as well as
+// the digest of their source: changing tools optimizes them again.
+static std::string cached_filename(const std::filesystem::path& input_path, const std::string& digest)
+{
+  return digest + '-' + image_tools().at(image_type(input_path)).name + input_path.extension().string();
+}
+
+ImageOptimizer::ImageOptimizer()
+{
+  // Statistics are created ahead, as jobs update them concurrently
+  for (const auto& candidates : image_tool_candidates)
+    statistics[candidates.first];
+}
+
+bool ImageOptimizer::accepts(const std::filesystem::path& path) const
+{
+  return enabled && image_tools().count(image_type(path)) > 0;
+}
+
+void ImageOptimizer::record(Statistics& stats, std::uintmax_t original_size, std::uintmax_t optimized_size)
+{
+  stats.original_bytes += original_size;
+  stats.optimized_bytes += optimized_size;
+}
+
+// Optimized images which are not smaller than the original are discarded,
+// and the original gets cached instead. When a tool fails, the original is
+// published, but not cached, so that it gets optimized again whenever it is
+// generated again.
+bool ImageOptimizer::optimize(const std::filesystem::path& input_path, const std::string& digest, const std::filesystem::path& output_path)
+{
+  std::string type = image_type(input_path);
+  const ExternalTool& tool = image_tools().at(type);
+  Statistics& stats = statistics.at(type);
+  std::filesystem::path cached_path = cache_directory / cached_filename(input_path, digest);
+  std::filesystem::path temporary_path = cache_directory / (output_path.filename().string() + ".tmp");
+  std::uintmax_t original_size, optimized_size;
+  std::error_code ec, cache_ec;
+  TraceSpan span("optimize", input_path.string(), true);
+
+  original_size = std::filesystem::file_size(input_path, ec);
+  if (ec)
+  {
+    job_error() << "[crails-assets] Cannot read `" << input_path.string() << "`: " << ec.message() << std::endl;
+    return false;
+  }
+  if (std::filesystem::exists(cached_path))
+  {
+    optimized_size = std::filesystem::file_size(cached_path, cache_ec);
+    if (!cache_ec && std::filesystem::copy_file(cached_path, output_path, std::filesystem::copy_options::overwrite_existing, cache_ec))
+    {
+      span.arg("cache", "hit");
+      stats.cached++;
+      record(stats, original_size, optimized_size);
+      return true;
+    }
+  }
+  span.arg("cache", "miss");
+  span.arg("tool", tool.name);
+  std::filesystem::create_directories(cache_directory, cache_ec);
+  if (verbose_mode)
+    job_output() << "+ " << image_command(tool, input_path, temporary_path) << std::endl;
+  if (!Crails::run_command(image_command(tool, input_path, temporary_path)) || !std::filesystem::exists(temporary_path))
+  {
+    job_error() << "[crails-assets] " << tool.name << " could not optimize " << input_path.string() << ", publishing it as is" << std::endl;
+    stats.failed++;
+    std::filesystem::remove(temporary_path, ec);
+    if (!std::filesystem::copy_file(input_path, output_path, std::filesystem::copy_options::overwrite_existing, ec))
+    {
+      job_error() << "[crails-assets] Cannot copy `" << input_path.string() << "`: " << ec.message() << std::endl;
+      return false;
+    }
+    record(stats, original_size, original_size);
+    return true;
+  }
+  optimized_size = std::filesystem::file_size(temporary_path, ec);
+  if (!ec && optimized_size < original_size)
+  {
+    stats.optimized++;
+    std::filesystem::copy_file(temporary_path, output_path, std::filesystem::copy_options::overwrite_existing, ec);
+    std::filesystem::rename(temporary_path, cached_path, cache_ec);
+  }
+  else
+  {
+    stats.unchanged++;
+    optimized_size = original_size;
+    std::filesystem::remove(temporary_path, cache_ec);
+    std::filesystem::copy_file(input_path, output_path, std::filesystem::copy_options::overwrite_existing, ec);
+    std::filesystem::copy_file(input_path, cached_path, std::filesystem::copy_options::overwrite_existing, cache_ec);
+  }
+  if (ec)
+  {
+    job_error() << "[crails-assets] Cannot write `" << output_path.string() << "`: " << ec.message() << std::endl;
+    return false;
+  }
+  span.arg("bytes_read", original_size);
+  span.arg("bytes_written", optimized_size);
+  record(stats, original_size, optimized_size);
+  if (verbose_mode)
+    job_output() << "[crails-assets] Optimized `" << input_path.string() << "` with " << tool.name << ": " << original_size << " -> " << optimized_size << " bytes" << std::endl;
+  return true;
+}
+
+// Removes the cached images which no longer match any asset
+void ImageOptimizer::cleanup(const FileMapper& filemap) const
+{
+  std::unordered_set<std::string> kept;
+  std::error_code ec;
+
+  if (!enabled || !std::filesystem::is_directory(cache_directory))
+    return ;
+  for (auto it = filemap.begin() ; it != filemap.end() ; ++it)
+  {
+    if (accepts(it->first))
+      kept.insert(cached_filename(it->first, it->second));
+  }
+  for (const auto& entry : std::filesystem::directory_iterator(cache_directory))
+  {
+    if (!kept.count(entry.path().filename().string()))
+    {
+      if (verbose_mode)
+        std::cout << "[crails-assets] removing outdated optimized image " << entry.path().string() << std::endl;
+      std::filesystem::remove(entry.path(), ec);
+    }
+  }
+}
+
+void ImageOptimizer::print_summary(std::ostream& stream) const
+{
+  for (const auto& entry : statistics)
+  {
+    const Statistics& stats = entry.second;
+    std::uintmax_t saved = stats.original_bytes - stats.optimized_bytes;
+
+    if (stats.optimized + stats.cached + stats.unchanged + stats.failed == 0)
+      continue ;
+    stream << "[crails-assets] " << entry.first << " (" << image_tools().at(entry.first).name << "): "
+           << stats.optimized << " optimized, " << stats.cached << " from cache, "
+           << stats.original_bytes << " -> " << stats.optimized_bytes << " bytes"
+           << " (saved " << saved << " bytes";
+    if (stats.original_bytes > 0)
+      stream << ", " << std::fixed << std::setprecision(1) << (saved * 100.0 / stats.original_bytes) << '%';
+    stream << "), " << stats.unchanged << " unchanged, " << stats.failed << " failed" << std::endl;
+  }
+}
+
+// Part of the build cache signature: images must be generated again when the
+// optimization gets enabled, disabled, or uses other tools.
+std::string ImageOptimizer::signature() const
+{
+  std::stringstream stream;
+
+  if (!enabled)
+    return "none";
+  for (const auto& tool : image_tools())
+    stream << tool.first << '=' << tool.second.name << ',';
+  return stream.str();
+}
@@ -0,0 +1,40 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <ostream>
+#include <string>
+
+struct FileMapper;
+
+// Recompresses images losslessly with the tools installed on the system:
+// oxipng or optipng for PNG, jpegtran for JPEG (optimized Huffman tables,
+// progressive encoding) and svgo for SVG. Each optimized image is stored in
+// cache_directory, named after its digest and tool, so that each version of
+// an image only gets optimized once.
+class ImageOptimizer
+{
+public:
+  struct Statistics
+  {
+    std::atomic<std::size_t>    optimized{0}, cached{0}, unchanged{0}, failed{0};
+    std::atomic<std::uintmax_t> original_bytes{0}, optimized_bytes{0};
+  };
+
+  ImageOptimizer();
+
+  bool                  enabled = false;
+  std::filesystem::path cache_directory;
+
+  bool        accepts(const std::filesystem::path& path) const;
+  bool        optimize(const std::filesystem::path& input_path, const std::string& digest, const std::filesystem::path& output_path);
+  void        cleanup(const FileMapper& filemap) const;
+  void        print_summary(std::ostream& stream) const;
+  std::string signature() const;
+
+private:
+  void record(Statistics& stats, std::uintmax_t original_size, std::uintmax_t optimized_size);
+
+  std::map<std::string, Statistics> statistics;
+};
@@ -0,0 +1,180 @@
+#include "job_scheduler.hpp"
+#include <algorithm>
+#include <iostream>
+#include <thread>
+
+static thread_local std::ostream* current_output = nullptr;
+static thread_local std::ostream* current_error = nullptr;
+
+std::ostream& job_output()
+{
+  return current_output ? *current_output : std::cout;
+}
+
+std::ostream& job_error()
+{
+  return current_error ? *current_error : std::cerr;
+}
+
+JobScheduler::JobScheduler(unsigned int worker_count) : worker_count(std::max(1u, worker_count))
+{
+}
+
+// Dependencies must be added before their dependents, which guarantees that
+// the job graph is acyclic.
+JobScheduler::JobId JobScheduler::add(Job job, const std::vector<JobId>& dependencies)
+{
+  JobId id = tasks.size();
+  auto  task = std::make_unique<Task>();
+
+  task->job = std::move(job);
+  for (JobId dependency : dependencies)
+  {
+    tasks.at(dependency)->dependents.push_back(id);
+    task->remaining_dependencies++;
+  }
+  tasks.push_back(std::move(task));
+  return id;
+}
+
+bool JobScheduler::run()
+{
+  std::vector<std::thread> threads;
+  unsigned int thread_count = std::min<std::size_t>(worker_count, tasks.size());
+
+  if (tasks.size() == 0)
+    return true;
+  remaining_jobs = tasks.size();
+  for (unsigned int i = 0 ; i < thread_count ; ++i)
+    queues.push_back(std::make_unique<WorkerQueue>());
+  for (JobId id = 0 ; id < tasks.size() ; ++id)
+  {
+    if (tasks[id]->remaining_dependencies == 0)
+      push_job(id % thread_count, id);
+  }
+  for (unsigned int i = 1 ; i < thread_count ; ++i)
+    threads.emplace_back(&JobScheduler::worker, this, i);
+  worker(0);
+  for (auto& thread : threads)
+    thread.join();
+  flush_outputs();
+  return std::all_of(tasks.begin(), tasks.end(), [](const std::unique_ptr<Task>& task) { return task->state == Succeeded; });
+}
+
+void JobScheduler::worker(unsigned int index)
+{
+  while (remaining_jobs > 0)
+  {
+    JobId id;
+
+    if (pop_job(index, id))
+    {
+      Task& task = *tasks[id];
+      bool success = false;
+
+      if (!task.dependency_failed)
+      {
+        current_output = &task.output;
+        current_error = &task.error;
+        try
+        {
+          success = task.job();
+        }
+        catch (const std::exception& error)
+        {
+          task.error << "[crails-assets] " << error.what() << std::endl;
+        }
+        current_output = current_error = nullptr;
+      }
+      complete_job(index, id, success);
+    }
+    else
+    {
+      std::unique_lock<std::mutex> lock(idle_mutex);
+
+      idle_condition.wait(lock, [this]() { return queued_jobs > 0 || remaining_jobs == 0; });
+    }
+  }
+}
+
+bool JobScheduler::pop_job(unsigned int index, JobId& id)
+{
+  for (unsigned int i = 0 ; i < queues.size() ; ++i)
+  {
+    WorkerQueue& queue = *queues[(index + i) % queues.size()];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+
+    if (queue.jobs.size() > 0)
+    {
+      // Workers run their own jobs last-in first-out, and steal the oldest jobs from others
+      if (i == 0)
+      {
+        id = queue.jobs.back();
+        queue.jobs.pop_back();
+      }
+      else
+      {
+        id = queue.jobs.front();
+        queue.jobs.pop_front();
+      }
+      queued_jobs--;
+      return true;
+    }
+  }
+  return false;
+}
+
+void JobScheduler::push_job(unsigned int index, JobId id)
+{
+  {
+    std::lock_guard<std::mutex> lock(queues[index]->mutex);
+    queues[index]->jobs.push_back(id);
+  }
+  {
+    std::lock_guard<std::mutex> lock(idle_mutex);
+    queued_jobs++;
+  }
+  idle_condition.notify_one();
+}
+
+void JobScheduler::complete_job(unsigned int index, JobId id, bool success)
+{
+  Task& task = *tasks[id];
+
+  task.state = success ? Succeeded : Failed;
+  for (JobId dependent_id : task.dependents)
+  {
+    Task& dependent = *tasks[dependent_id];
+
+    if (!success)
+      dependent.dependency_failed = true;
+    if (--dependent.remaining_dependencies == 0)
+      push_job(index, dependent_id);
+  }
+  {
+    std::lock_guard<std::mutex> lock(flush_mutex);
+    task.done = true;
+  }
+  flush_outputs();
+  {
+    std::lock_guard<std::mutex> lock(idle_mutex);
+    remaining_jobs--;
+  }
+  if (remaining_jobs == 0)
+    idle_condition.notify_all();
+}
+
+void JobScheduler::flush_outputs()
+{
+  std::lock_guard<std::mutex> lock(flush_mutex);
+
+  for (; next_flush < tasks.size() && tasks[next_flush]->done ; ++next_flush)
+  {
+    Task& task = *tasks[next_flush];
+
+    std::cout << task.output.str() << std::flush;
+    std::cerr << task.error.str() << std::flush;
+    task.output.str("");
+    task.error.str("");
+  }
+}
@@ -0,0 +1,70 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <vector>
+
+// Runs a graph of jobs over a pool of workers. Each worker owns a queue,
+// and steals from the other queues when its own runs dry. A job only runs
+// once all of its dependencies succeeded: the dependents of a failed job
+// are never run, and are reported as failed.
+//
+// Jobs write their messages to job_output() and job_error(). These are
+// buffered, then flushed in the order in which the jobs were added, so
+// that the output does not depend on scheduling.
+class JobScheduler
+{
+public:
+  typedef std::size_t           JobId;
+  typedef std::function<bool()> Job;
+
+  JobScheduler(unsigned int worker_count);
+
+  JobId add(Job job, const std::vector<JobId>& dependencies = {});
+  bool  run();
+  bool  succeeded(JobId id) const { return tasks.at(id)->state == Succeeded; }
+  unsigned int get_worker_count() const { return worker_count; }
+
+private:
+  enum State { Pending, Succeeded, Failed };
+
+  struct Task
+  {
+    Job                      job;
+    std::vector<JobId>       dependents;
+    std::atomic<unsigned int> remaining_dependencies{0};
+    std::atomic<bool>        dependency_failed{false};
+    State                    state = Pending;
+    bool                     done = false;
+    std::stringstream        output, error;
+  };
+
+  struct WorkerQueue
+  {
+    std::mutex        mutex;
+    std::deque<JobId> jobs;
+  };
+
+  void worker(unsigned int index);
+  bool pop_job(unsigned int index, JobId& id);
+  void push_job(unsigned int index, JobId id);
+  void complete_job(unsigned int index, JobId id, bool success);
+  void flush_outputs();
+
+  unsigned int                              worker_count;
+  std::vector<std::unique_ptr<Task>>        tasks;
+  std::vector<std::unique_ptr<WorkerQueue>> queues;
+  std::atomic<std::size_t>                  remaining_jobs{0};
+  std::atomic<std::size_t>                  queued_jobs{0};
+  std::mutex                                idle_mutex;
+  std::condition_variable                   idle_condition;
+  std::mutex                                flush_mutex;
+  JobId                                     next_flush = 0;
+};
+
+std::ostream& job_output();
+std::ostream& job_error();
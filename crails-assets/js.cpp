@@ -5,12 +5,21 @@
 #include <crails/cli/filesystem.hpp>
 #include <crails/read_file.hpp>
 #include <iostream>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <unistd.h>
 #include "file_mapper.hpp"
+#include "job_scheduler.hpp"
+#include "trace.hpp"
+#include "js.hpp"
+#include "external_tool.hpp"
 
 extern bool with_source_maps;
 extern bool verbose_mode;
 
 std::string public_path_for(const std::pair<std::string,std::string>& name_and_checksum);
+bool inject_asset_path(const FileMapper& filemap, const std::filesystem::path& input_path, std::string_view data, std::string& output, std::vector<std::string>& missing);
 
 static const std::vector<std::string> minify_candidates{
   "uglifyjs",
@@ -23,46 +32,95 @@ static const std::map<std::string, std::string> minify_options{
   {"yuicompressor",    "\"$input\" -o \"$output\""}
 };
 
+// Runs the uglify-js API over a list of `input<TAB>output<TAB>sourcemap` lines,
+// reporting the outcome and duration of each minification on stdout.
+static const char* uglify_batch_script = R"(
+const fs = require('fs');
+const path = require('path');
+const UglifyJS = require(process.argv[2]);
+const jobs = fs.readFileSync(process.argv[3], 'utf8').split('\n').filter(line => line.length > 0);
+jobs.forEach(function(line, index) {
+  const [input, output, sourceMap] = line.split('\t');
+  const start = Date.now();
+  const options = { compress: {}, mangle: false };
+  if (sourceMap === '1')
+    options.sourceMap = { filename: path.basename(output) };
+  const result = UglifyJS.minify(fs.readFileSync(input, 'utf8'), options);
+  if (result.error)
+    console.log('error\t' + index + '\t' + String(result.error.message).replace(/\s+/g, ' '));
+  else {
+    fs.writeFileSync(output, result.code);
+    if (result.map)
+      fs.writeFileSync(output + '.map', result.map);
+    console.log('ok\t' + index + '\t' + (Date.now() - start));
+  }
+});
+)";
+
+struct BatchOutput
+{
+  unsigned long duration;
+};
+
+static std::mutex                                          batch_mutex;
+static std::map<std::filesystem::path, BatchOutput>        batch_outputs;
+static std::filesystem::path                               batch_directory;
+
 static std::pair<std::string, std::string> find_minify()
 {
-  for (const std::string& candidate : minify_candidates)
-  {
-    std::string result = Crails::which(candidate);
+  ExternalTool tool = find_external_tool(minify_candidates);
 
-    if (result.length() > 0)
-      return {candidate, result};
-  }
-  return {"", ""};
+  return {tool.name, tool.path};
+}
+
+// The minifier is only looked up once per run
+static const std::pair<std::string, std::string>& get_minify()
+{
+  static const std::pair<std::string, std::string> minifier = find_minify();
+
+  return minifier;
+}
+
+std::string minify_implementation()
+{
+  return get_minify().second;
 }
 
-static std::string replace_options(const std::string& source, const std::map<std::string, std::string> vars)
+// Batches require the uglify-js module, next to the uglifyjs executable, and node
+static std::pair<std::string, std::filesystem::path> find_uglify_module()
 {
-  std::string result = source;
+  const auto& minifier = get_minify();
+  std::string node = Crails::which("node");
+  std::error_code error;
 
-  for (auto it = vars.begin() ; it != vars.end() ; ++it)
+  if (minifier.first == "uglifyjs" && node.length() > 0)
   {
-    auto position = result.find('$' + it->first);
+    auto module_path = std::filesystem::canonical(minifier.second, error).parent_path().parent_path();
 
-    if (position != std::string::npos)
-      result = result.substr(0, position) + it->second + result.substr(position + it->first.length() + 1);
+    if (!error && std::filesystem::exists(module_path / "tools" / "node.js"))
+      return {node, module_path};
   }
-  return result;
+  return {"", ""};
+}
+
+static const std::pair<std::string, std::filesystem::path>& get_uglify_module()
+{
+  static const std::pair<std::string, std::filesystem::path> uglify_module = find_uglify_module();
+
+  return uglify_module;
 }
 
 static void replace_wasm_in_comet_javascript(const std::filesystem::path& input_path, const FileMapper& filemap, std::string& contents)
 {
   auto wasm_filepath = std::filesystem::path(input_path).replace_extension("wasm");
   auto wasm_pattern = '\'' + wasm_filepath.filename().string() + '\'';
-  std::string wasm_key;
+  auto wasm_file = filemap.find(wasm_filepath.string());
   std::size_t pattern_position;
 
-  if ((pattern_position = contents.find_last_of(wasm_pattern)) != std::string::npos)
+  if (wasm_file != filemap.end() && (pattern_position = contents.rfind(wasm_pattern)) != std::string::npos)
   {
-    if (filemap.get_key_from_alias(wasm_filepath.string(), wasm_key))
-    {
-      std::string wasm_public_path = public_path_for({wasm_key, filemap.at(wasm_filepath.string())});
-      contents.replace(pattern_position, wasm_pattern.length(), '\'' + wasm_public_path + '\'');
-    }
+    std::string wasm_public_path = public_path_for(*wasm_file);
+    contents.replace(pattern_position, wasm_pattern.length(), '\'' + wasm_public_path + '\'');
   }
 }
 
@@ -81,44 +139,200 @@ static void replace_sourcemaps(std::string& contents, const std::filesystem::pat
 
 static bool already_has_sourcemaps(const std::filesystem::path& input_path, const FileMapper& filemap)
 {
-  std::string boop;
+  return filemap.find(input_path.string() + ".map") != filemap.end();
+}
+
+static bool load_javascript(const std::filesystem::path& input_path, const FileMapper& filemap, const PostFilter& post_filter, std::string& contents)
+{
+  std::string source;
 
-  return filemap.find(input_path.filename().string() + ".map") != filemap.end();
+  Crails::read_file(input_path.string(), source);
+  replace_wasm_in_comet_javascript(input_path.string(), filemap, source);
+  return post_filter(source, contents);
 }
 
-bool generate_js(const std::filesystem::path& input_path, const std::filesystem::path& output_path, const FileMapper& filemap)
+std::vector<JsBatch> make_js_batches(const std::vector<JsBatch::Entry>& files, unsigned int batch_count)
 {
-  auto minifier = find_minify();
+  std::vector<JsBatch> batches;
+
+  if (get_uglify_module().first.length() == 0 || files.size() == 0)
+    return batches;
+  batches.resize(std::min<std::size_t>(std::max(1u, batch_count), files.size()));
+  for (std::size_t i = 0 ; i < files.size() ; ++i)
+    batches[i % batches.size()].entries.push_back(files[i]);
+  {
+    std::string directory_template = (std::filesystem::temp_directory_path() / "crails-assets-js-XXXXXX").string();
+
+    if (mkdtemp(directory_template.data()) && Crails::write_file("crails-assets", directory_template + "/batch.js", uglify_batch_script))
+      batch_directory = directory_template;
+    else
+      batches.clear();
+  }
+  return batches;
+}
+
+void cleanup_js_batches()
+{
+  std::error_code error;
+
+  if (batch_directory.string().length() > 0)
+    std::filesystem::remove_all(batch_directory, error);
+  batch_directory.clear();
+  batch_outputs.clear();
+}
+
+bool JsBatch::compile(unsigned int index, const FileMapper& filemap) const
+{
+  const auto& uglify_module = get_uglify_module();
+  std::filesystem::path job_list = batch_directory / (std::to_string(index) + ".jobs");
+  std::stringstream jobs, command;
+  std::string output;
+  std::vector<std::size_t> batched_entries;
+
+  for (std::size_t i = 0 ; i < entries.size() ; ++i)
+  {
+    std::filesystem::path input = batch_directory / (std::to_string(index) + '-' + std::to_string(i) + ".js");
+    bool with_map = with_source_maps && !already_has_sourcemaps(entries[i].input_path, filemap);
+    std::vector<std::string> missing;
+    std::string contents;
+    PostFilter silent_filter = [&](std::string_view data, std::string& output)
+    {
+      return inject_asset_path(filemap, entries[i].input_path, data, output, missing);
+    };
+
+    // Scripts referencing missing assets are left to generate_js, which reports the errors
+    if (!load_javascript(entries[i].input_path, filemap, silent_filter, contents))
+      continue ;
+    if (!Crails::write_file("crails-assets", input.string(), contents))
+      return true;
+    jobs << input.string() << '\t' << entries[i].output_path.string() << '\t' << with_map << '\n';
+    batched_entries.push_back(i);
+  }
+  if (batched_entries.size() == 0)
+    return true;
+  if (!Crails::write_file("crails-assets", job_list.string(), jobs.str()))
+    return true;
+  command << uglify_module.first << " \"" << (batch_directory / "batch.js").string() << "\" \""
+          << uglify_module.second.string() << "\" \"" << job_list.string() << '"';
+  if (verbose_mode)
+    job_output() << "[crails-assets] minify batch command: " << command.str() << std::endl;
+  // Even when the batch fails, the files that were minified can be used
+  {
+    TraceSpan span("minify", "batch " + std::to_string(index), true);
+
+    span.arg("inputs", batched_entries.size());
+    Crails::run_command(command.str(), output);
+  }
+  {
+    std::istringstream lines(output);
+    std::string status;
+    std::size_t entry_index;
+    unsigned long duration;
+
+    while (lines >> status >> entry_index)
+    {
+      if (entry_index >= batched_entries.size())
+        break ;
+      entry_index = batched_entries[entry_index];
+      if (status == "ok" && lines >> duration)
+      {
+        std::lock_guard<std::mutex> lock(batch_mutex);
+        batch_outputs.emplace(entries[entry_index].input_path, BatchOutput{duration});
+      }
+      std::getline(lines, status);
+      if (verbose_mode && status.length() > 0)
+        job_output() << "[crails-assets] batch could not minify " << entries[entry_index].input_path.string() << ":" << status << std::endl;
+    }
+  }
+  return true;
+}
+
+static bool fetch_batch_output(const std::filesystem::path& input_path, BatchOutput& output)
+{
+  std::lock_guard<std::mutex> lock(batch_mutex);
+  auto it = batch_outputs.find(input_path);
+
+  if (it != batch_outputs.end())
+  {
+    output = it->second;
+    return true;
+  }
+  return false;
+}
+
+static bool minify_javascript(const std::pair<std::string, std::string>& minifier, const std::string& contents, const std::filesystem::path& output_path, bool has_sourcemaps)
+{
+  std::stringstream command;
+  std::string temporary_file = (std::filesystem::temp_directory_path() / "crails-assets-XXXXXX.js").string();
+  int fd = mkstemps(temporary_file.data(), 3);
+  bool success;
+
+  if (fd < 0)
+  {
+    job_error() << "[crails-assets] cannot create temporary file " << temporary_file << std::endl;
+    return false;
+  }
+  close(fd);
+  Crails::write_file("crails-assets", temporary_file, contents);
+  command << minifier.second
+    << ' ' << replace_variables(minify_options.at(minifier.first), {{"input", temporary_file}, {"output", output_path.string()}});
+  if (with_source_maps && !has_sourcemaps)
+  {
+    if (minifier.first == "uglifyjs")
+      command << " --source-map";
+    else if (minifier.first == "closure-compiler")
+      command << " --create_source_map \"" << (output_path.string() + ".map") << '"';
+  }
+  if (verbose_mode)
+    job_output() << "+ " << command.str() << std::endl;
+  {
+    TraceSpan span("minify", output_path.string(), true);
+
+    span.arg("bytes_read", contents.length());
+    success = Crails::run_command(command.str());
+  }
+  std::filesystem::remove(temporary_file);
+  return success;
+}
+
+bool generate_js(const std::filesystem::path& input_path, const std::filesystem::path& output_path, const FileMapper& filemap, const PostFilter& post_filter)
+{
+  const auto& minifier = get_minify();
   std::string contents;
   bool has_sourcemaps = already_has_sourcemaps(input_path, filemap);
 
-  Crails::read_file(input_path.string(), contents);
-  replace_wasm_in_comet_javascript(input_path.string(), filemap, contents);
   if (minifier.first.length() > 0)
   {
-    std::stringstream command;
-    std::string temporary_file = std::filesystem::temp_directory_path().string() + "/tmp.js";
+    BatchOutput batch_output;
+    auto start = std::chrono::steady_clock::now();
 
-    Crails::write_file("crails-assets", temporary_file, contents);
-    command << minifier.second
-      << ' ' << replace_options(minify_options.at(minifier.first), {{"input", temporary_file}, {"output", output_path.string()}});
-    if (with_source_maps && !has_sourcemaps)
+    if (fetch_batch_output(input_path, batch_output))
     {
-      if (minifier.first == "uglifyjs")
-        command << " --source-map";
-      else if (minifier.first == "closure-compiler")
-        command << " --create_source_map \"" << (output_path.string() + ".map") << '"';
+      if (verbose_mode)
+        job_output() << "[crails-assets] minified " << input_path.string() << " in " << batch_output.duration << "ms (batch)" << std::endl;
+    }
+    else
+    {
+      if (!load_javascript(input_path, filemap, post_filter, contents) ||
+          !minify_javascript(minifier, contents, output_path, has_sourcemaps))
+        return false;
+      if (verbose_mode)
+        job_output() << "[crails-assets] minified " << input_path.string() << " in "
+                     << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count() << "ms" << std::endl;
     }
-    if (verbose_mode)
-      std::cout << "+ " << command.str() << std::endl;
-    if (!Crails::run_command(command.str()))
-      return false;
     if (!has_sourcemaps)
       return true;
     Crails::read_file(output_path.string(), contents);
+    // The sourceMappingURL comment must be on the last line of its own
+    if (contents.length() > 0 && contents.back() != '\n')
+      contents += '\n';
     contents += sourcemap_comment(output_path);
   }
   else
+  {
+    if (!load_javascript(input_path, filemap, post_filter, contents))
+      return false;
     replace_sourcemaps(contents, output_path);
+  }
   return Crails::write_file("crails-assets", output_path.string(), contents);
 }
@@ -0,0 +1,28 @@
+#pragma once
+#include <filesystem>
+#include <string>
+#include <vector>
+#include "asset_path_scanner.hpp"
+
+struct FileMapper;
+
+// Minifies several javascript files with a single process, running the
+// uglify-js API through node. Batches are compiled ahead of generate_js,
+// which then only needs to finalize the minified file. Files that a batch
+// failed to minify are minified individually by generate_js.
+struct JsBatch
+{
+  struct Entry
+  {
+    std::filesystem::path input_path, output_path;
+  };
+
+  std::vector<Entry> entries;
+
+  bool compile(unsigned int index, const FileMapper& filemap) const;
+};
+
+std::string          minify_implementation();
+std::vector<JsBatch> make_js_batches(const std::vector<JsBatch::Entry>& files, unsigned int batch_count);
+void                 cleanup_js_batches();
+bool                 generate_js(const std::filesystem::path& input_path, const std::filesystem::path& output_path, const FileMapper& filemap, const PostFilter& post_filter);
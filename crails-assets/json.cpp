@@ -0,0 +1,23 @@
+#include "json.hpp"
+#include <cstdio>
+
+std::string json_string(std::string_view value)
+{
+  std::string result("\"");
+
+  for (char c : value)
+  {
+    if (c == '"' || c == '\\')
+      result += '\\';
+    if (static_cast<unsigned char>(c) < 0x20)
+    {
+      char escaped[8];
+
+      std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+      result += escaped;
+    }
+    else
+      result += c;
+  }
+  return result + '"';
+}
@@ -0,0 +1,6 @@
+#pragma once
+#include <string>
+#include <string_view>
+
+// Quotes and escapes a value as a JSON string
+std::string json_string(std::string_view value);
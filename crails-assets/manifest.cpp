@@ -0,0 +1,155 @@
+#include <crails/cli/filesystem.hpp>
+#include <filesystem>
+#include <sstream>
+#include <iostream>
+#include "manifest.hpp"
+#include "build_cache.hpp"
+#include "file_mapper.hpp"
+#include "mapped_file.hpp"
+#include "mime_type.hpp"
+#include "digest.hpp"
+#include "json.hpp"
+
+bool public_filename_for(const FileMapper& filemap, const std::string& key, std::string& filename);
+
+extern const std::string public_scope;
+
+// Names from the Content-Encoding header
+static std::string_view encoding_for(const ManifestEntry& entry, std::size_t index)
+{
+  std::filesystem::path output(entry.outputs[index]);
+
+  if (index > 0 && output.extension() == ".gz")
+    return "gzip";
+  if (index > 0 && output.extension() == ".br")
+    return "br";
+  return "identity";
+}
+
+static void write_binary_integer(std::string& output, std::uint64_t value, int bytes)
+{
+  for (int i = 0 ; i < bytes ; ++i)
+    output += static_cast<char>((value >> (i * 8)) & 0xff);
+}
+
+static void write_binary_string(std::string& output, std::string_view value)
+{
+  write_binary_integer(output, value.length(), 4);
+  output += value;
+}
+
+// Files skipped by the generation, and missing from the build cache, are read
+// once to get their integrity.
+bool AssetManifest::complete(const FileMapper& filemap, const std::string& output_directory, BuildCache& cache)
+{
+  std::filesystem::path output_base(output_directory + '/' + public_scope);
+  bool success = true;
+
+  for (auto it = filemap.begin() ; it != filemap.end() ; ++it)
+  {
+    ManifestEntry entry;
+    std::string filename;
+    auto current = find(it->first);
+
+    if (!public_filename_for(filemap, it->first, filename))
+      continue ;
+    if (current != end() && current->second.integrity.length() > 0 && current->second.outputs.size() > 0 && current->second.outputs.front() == filename)
+      continue ;
+    {
+      MappedFile file(output_base / filename);
+
+      if (!file.is_open())
+      {
+        std::cerr << "[crails-assets] cannot read " << (output_base / filename).string() << " for the manifest" << std::endl;
+        success = false;
+        continue ;
+      }
+      entry.integrity = subresource_integrity(file.data());
+      entry.outputs.push_back(filename);
+      entry.output_sizes.push_back(file.size());
+    }
+    for (const char* extension : {".gz", ".br"})
+    {
+      std::error_code error;
+      std::uintmax_t size = std::filesystem::file_size(output_base / (filename + extension), error);
+
+      if (!error)
+      {
+        entry.outputs.push_back(filename + extension);
+        entry.output_sizes.push_back(size);
+      }
+    }
+    cache.store_outputs(it->first, entry.outputs, entry.output_sizes, entry.integrity);
+    (*this)[it->first] = entry;
+  }
+  return success;
+}
+
+std::string AssetManifest::json(const FileMapper& filemap) const
+{
+  std::stringstream stream;
+  bool first = true;
+
+  stream << '{';
+  for (auto it = filemap.begin() ; it != filemap.end() ; ++it)
+  {
+    auto entry = find(it->first);
+
+    if (entry == end() || entry->second.outputs.empty())
+      continue ;
+    stream << (first ? "" : ",") << std::endl
+           << "  " << json_string(filemap.get_alias(it->first)) << ": {" << std::endl
+           << "    \"path\": " << json_string('/' + public_scope + entry->second.outputs.front()) << ',' << std::endl
+           << "    \"digest\": " << json_string(it->second) << ',' << std::endl
+           << "    \"integrity\": " << json_string(entry->second.integrity) << ',' << std::endl
+           << "    \"type\": " << json_string(mime_type_for(entry->second.outputs.front())) << ',' << std::endl
+           << "    \"sizes\": {";
+    for (std::size_t i = 0 ; i < entry->second.outputs.size() ; ++i)
+      stream << (i > 0 ? ", " : "") << json_string(encoding_for(entry->second, i)) << ": " << entry->second.output_sizes[i];
+    stream << '}' << std::endl << "  }";
+    first = false;
+  }
+  stream << std::endl << '}' << std::endl;
+  return stream.str();
+}
+
+// Little-endian, strings prefixed by their 32 bits length:
+//   "CRAM" version:u32 count:u32
+//   count * (alias path digest integrity type encoding_count:u32 encoding_count * (encoding size:u64))
+std::string AssetManifest::binary_data(const FileMapper& filemap) const
+{
+  std::string output("CRAM");
+  std::string entries;
+  std::uint32_t count = 0;
+
+  for (auto it = filemap.begin() ; it != filemap.end() ; ++it)
+  {
+    auto entry = find(it->first);
+
+    if (entry == end() || entry->second.outputs.empty())
+      continue ;
+    write_binary_string(entries, filemap.get_alias(it->first));
+    write_binary_string(entries, '/' + public_scope + entry->second.outputs.front());
+    write_binary_string(entries, it->second);
+    write_binary_string(entries, entry->second.integrity);
+    write_binary_string(entries, mime_type_for(entry->second.outputs.front()));
+    write_binary_integer(entries, entry->second.outputs.size(), 4);
+    for (std::size_t i = 0 ; i < entry->second.outputs.size() ; ++i)
+    {
+      write_binary_string(entries, encoding_for(entry->second, i));
+      write_binary_integer(entries, entry->second.output_sizes[i], 8);
+    }
+    count++;
+  }
+  write_binary_integer(output, 1, 4);
+  write_binary_integer(output, count, 4);
+  return output + entries;
+}
+
+bool AssetManifest::save(const FileMapper& filemap, const std::string& output_directory) const
+{
+  if (!enabled)
+    return true;
+  return Crails::write_file("crails-assets", output_directory + "/manifest.json", json(filemap))
+      && (!binary || Crails::write_file("crails-assets", output_directory + "/manifest.bin", binary_data(filemap)));
+}
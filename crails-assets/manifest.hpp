@@ -0,0 +1,34 @@
+#pragma once
+#include <map>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+struct FileMapper;
+class BuildCache;
+
+struct ManifestEntry
+{
+  std::string                 integrity;
+  std::vector<std::string>    outputs; // the public file, then its compressed variants
+  std::vector<std::uintmax_t> output_sizes;
+};
+
+// Describes the public files produced for each source, for deploy tools and
+// servers. The integrity and sizes are collected while the files are being
+// generated and compressed, or from the build cache for unchanged files.
+// Entries missing from both are completed from the public folder, and stored
+// in the build cache, which must be saved afterwards.
+class AssetManifest : public std::map<std::string, ManifestEntry>
+{
+public:
+  bool enabled = false;
+  bool binary = false;
+
+  bool complete(const FileMapper& filemap, const std::string& output_directory, BuildCache& cache);
+  bool save(const FileMapper& filemap, const std::string& output_directory) const;
+
+private:
+  std::string json(const FileMapper& filemap) const;
+  std::string binary_data(const FileMapper& filemap) const;
+};
@@ -0,0 +1,152 @@
+#include <crails/cli/filesystem.hpp>
+#include <crails/read_file.hpp>
+#include <crails/utils/split.hpp>
+#include <filesystem>
+#include <unordered_set>
+#include <algorithm>
+#include <sstream>
+#include <iostream>
+#include "file_mapper.hpp"
+#include "responsive_images.hpp"
+
+bool public_filename_for(const FileMapper& filemap, const std::string& key, std::string& filename);
+
+extern bool verbose_mode;
+extern const std::string public_scope;
+
+// Each run appends the list of files it produced to the generations file
+// of the output folder, one generation per line. Pruning only removes the
+// files of the generations that fell out of the last kept ones, so that the
+// pages served by the previous releases still find their assets during
+// rolling deploys, and files that were never recorded are left alone.
+static std::vector<std::vector<std::string>> load_generations(const std::filesystem::path& path)
+{
+  std::vector<std::vector<std::string>> generations;
+  std::string contents;
+
+  if (Crails::read_file(path.string(), contents))
+  {
+    for (const std::string& line : Crails::split(contents, '\n'))
+    {
+      auto files = Crails::split(line, '\t');
+
+      generations.emplace_back(files.begin(), files.end());
+    }
+  }
+  return generations;
+}
+
+static bool save_generations(const std::filesystem::path& path, const std::vector<std::vector<std::string>>& generations)
+{
+  std::stringstream stream;
+
+  for (const auto& generation : generations)
+  {
+    for (std::size_t i = 0 ; i < generation.size() ; ++i)
+      stream << (i > 0 ? "\t" : "") << generation[i];
+    stream << '\n';
+  }
+  return Crails::write_file("crails-assets", path.string(), stream.str());
+}
+
+// Compressed variants and generated sourcemaps belong to the same generation
+// as their original file
+static std::string original_filename(const std::string& filename)
+{
+  std::filesystem::path path(filename);
+
+  if (path.extension() == ".gz" || path.extension() == ".br" || path.extension() == ".map")
+    return original_filename(path.replace_extension().string());
+  return filename;
+}
+
+static bool discard_file(const std::filesystem::path& path, const std::string& quarantine)
+{
+  std::error_code ec;
+
+  if (quarantine.length() > 0)
+  {
+    std::filesystem::create_directories(quarantine, ec);
+    std::filesystem::rename(path, std::filesystem::path(quarantine) / path.filename(), ec);
+  }
+  else
+    std::filesystem::remove(path, ec);
+  if (ec)
+    std::cerr << "[crails-assets] cannot prune `" << path.string() << "`: " << ec.message() << std::endl;
+  return !ec;
+}
+
+// Builds of the same run (see --watch) are merged into a single generation,
+// so that rebuilds don't use up the generations kept by --prune.
+bool record_generation(const FileMapper& filemap, const std::string& output_directory, bool new_run)
+{
+  std::filesystem::path generations_path(output_directory + "/.crails-assets.generations");
+  std::vector<std::vector<std::string>> generations = load_generations(generations_path);
+  std::vector<std::string> current;
+
+  for (auto it = filemap.begin() ; it != filemap.end() ; ++it)
+  {
+    std::string filename;
+
+    if (public_filename_for(filemap, it->first, filename))
+      current.push_back(filename);
+    for (const ImageVariant& variant : responsive_images.variants_for(filemap, it->first))
+      current.push_back(variant.filename);
+  }
+  if (!new_run && !generations.empty())
+  {
+    current.insert(current.end(), generations.back().begin(), generations.back().end());
+    generations.pop_back();
+  }
+  std::sort(current.begin(), current.end());
+  current.erase(std::unique(current.begin(), current.end()), current.end());
+  if (generations.empty() || generations.back() != current)
+    generations.push_back(current);
+  return save_generations(generations_path, generations);
+}
+
+bool prune_public_folder(const std::string& output_directory, unsigned int kept_generations, const std::string& quarantine)
+{
+  std::filesystem::path generations_path(output_directory + "/.crails-assets.generations");
+  std::filesystem::path output_base(output_directory + '/' + public_scope);
+  std::vector<std::vector<std::string>> generations = load_generations(generations_path);
+  std::unordered_set<std::string> kept;
+  std::unordered_set<std::string> outdated;
+  std::uintmax_t freed_bytes = 0;
+  unsigned int pruned_count = 0;
+  bool success = true;
+
+  kept_generations = std::max(1u, kept_generations);
+  if (generations.size() > kept_generations)
+  {
+    for (auto it = generations.begin() ; it != generations.end() - kept_generations ; ++it)
+      outdated.insert(it->begin(), it->end());
+    generations.erase(generations.begin(), generations.end() - kept_generations);
+  }
+  for (const auto& generation : generations)
+    kept.insert(generation.begin(), generation.end());
+  for (const auto& entry : std::filesystem::directory_iterator(output_base))
+  {
+    std::string filename = original_filename(entry.path().filename().string());
+    std::error_code ec;
+    std::uintmax_t size;
+
+    if (!entry.is_regular_file() || !outdated.count(filename) || kept.count(filename))
+      continue ;
+    size = entry.file_size(ec);
+    if (verbose_mode)
+      std::cout << "[crails-assets] pruning " << entry.path().string() << std::endl;
+    if (discard_file(entry.path(), quarantine))
+    {
+      freed_bytes += ec ? 0 : size;
+      pruned_count++;
+    }
+    else
+      success = false;
+  }
+  std::cout << "[crails-assets] pruned " << pruned_count << " files";
+  if (quarantine.length() > 0)
+    std::cout << " to " << quarantine;
+  std::cout << ", freed " << freed_bytes << " bytes (keeping " << generations.size() << " generations)" << std::endl;
+  return save_generations(generations_path, generations) && success;
+}
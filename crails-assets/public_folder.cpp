@@ -1,27 +1,57 @@
 #include "file_mapper.hpp"
-#include "compression.hpp"
-#include <crails/cli/process.hpp>
+#include "compression_policy.hpp"
+#include "build_cache.hpp"
+#include "job_scheduler.hpp"
+#include "mapped_file.hpp"
+#include "sass.hpp"
+#include "js.hpp"
+#include "bundle.hpp"
+#include "image_optimizer.hpp"
+#include "responsive_images.hpp"
+#include "asset_path_scanner.hpp"
+#include "manifest.hpp"
+#include "digest.hpp"
+#include "trace.hpp"
+#include <crails/cli/filesystem.hpp>
 #include <filesystem>
 #include <functional>
-#include <regex>
+#include <list>
+#include <algorithm>
 #include <iostream>
 
-typedef std::function<std::string(const std::string&)> PostFilter;
-
 extern bool verbose_mode;
+extern unsigned short checksum_length;
+extern unsigned int job_count;
 
-const std::string public_scope = "assets/";
-
-bool generate_sass(const std::filesystem::path& input_path, const std::filesystem::path& output_path, PostFilter post_filter);
-bool generate_js(const std::filesystem::path& input_path, const std::filesystem::path& output_path, const FileMapper&);
+extern const std::string public_scope = "assets/";
 
 static std::string filename_with_checksum(const std::pair<std::string, std::string>& name_and_checksum)
 {
   std::filesystem::path filepath(name_and_checksum.first);
+  std::string checksum = name_and_checksum.second.substr(0, checksum_length > 0 ? checksum_length : std::string::npos);
 
+  // Bundles are published under the name of the file they produce
+  if (is_bundle(filepath))
+    filepath = filepath.stem();
   if (filepath.has_stem())
-    return filepath.stem().string() + '-' + name_and_checksum.second + filepath.extension().string();
-  return filepath.filename().string() + '-' + name_and_checksum.second;
+    return filepath.stem().string() + '-' + checksum + filepath.extension().string();
+  return filepath.filename().string() + '-' + checksum;
+}
+
+// Map files are named after the file they map, so that both share the same checksum
+bool public_filename_for(const FileMapper& filemap, const std::string& key, std::string& filename)
+{
+  if (key.ends_with(".map"))
+  {
+    auto mapped_file = filemap.find(key.substr(0, key.length() - 4));
+
+    if (mapped_file == filemap.end())
+      return false;
+    filename = filename_with_checksum(*mapped_file) + ".map";
+  }
+  else
+    filename = filename_with_checksum({key, filemap.at(key)});
+  return true;
 }
 
 std::string public_path_for(const std::pair<std::string,std::string>& name_and_checksum)
@@ -29,67 +59,212 @@ std::string public_path_for(const std::pair<std::string,std::string>& name_and_c
   return '/' + public_scope + filename_with_checksum(name_and_checksum);
 }
 
-static std::string inject_asset_path(const FileMapper& filemap, const std::string& data)
+// Scripts get the public paths as string literals, while stylesheets and
+// documents use them inside url() calls or attributes.
+bool inject_asset_path(const FileMapper& filemap, const std::filesystem::path& input_path, std::string_view data, std::string& output, std::vector<std::string>& missing)
 {
-  std::regex  pattern("asset_path\\(\"([^\"]+)\"\\)");
-  auto        match = std::sregex_iterator(data.begin(), data.end(), pattern);
-  std::string result;
-  std::size_t last_pos = 0;
-  std::size_t prefix_len = 11;
-
-  while (match != std::sregex_iterator())
+  AssetPathResolver resolve = [&filemap](std::string_view alias, std::string& public_path)
   {
-    std::string asset_path = (*match)[1].str();
     std::string asset_key;
 
-    if (filemap.get_key_from_alias(asset_path, asset_key))
-    {
-      std::string public_asset_path = public_path_for({asset_key, filemap.at(asset_key)});
-
-      result += data.substr(last_pos, match->position() - last_pos);
-      result += public_asset_path;
-      last_pos = match->position() + match->length();
-    }
-    else
+    if (filemap.get_key_from_alias(std::string(alias), asset_key))
     {
-      std::cout << "inject_asset_path: asset not found: " << asset_path << std::endl;
-      return "";
+      public_path = public_path_for({asset_key, filemap.at(asset_key)});
+      return true;
     }
-    match++;
-  }
-  result += data.substr(last_pos);
-  return result;
+    return false;
+  };
+
+  return rewrite_asset_paths(data, output, resolve, missing, input_path.extension() == ".js");
+}
+
+static PostFilter make_post_filter(const FileMapper& filemap, const std::filesystem::path& input_path)
+{
+  return [&filemap, input_path](std::string_view data, std::string& output)
+  {
+    std::vector<std::string> missing;
+
+    if (inject_asset_path(filemap, input_path, data, output, missing))
+      return true;
+    for (const std::string& alias : missing)
+      job_error() << "[crails-assets] " << input_path.string() << ": asset not found: " << alias << std::endl;
+    return false;
+  };
 }
 
 static bool copy_file(const std::filesystem::path& input_path, const std::filesystem::path& output_path)
 {
   std::error_code ec;
-  std::filesystem::copy_file(input_path, output_path, std::filesystem::copy_options::none, ec);
-  if (verbose_mode)
+  std::filesystem::copy_file(input_path, output_path, std::filesystem::copy_options::overwrite_existing, ec);
+  if (ec)
   {
-    if (ec)
-      std::cout << "[crails-assets] No changes with " << input_path.string() << std::endl;
-    else
-      std::cout << "[crails-assets] Copied `" << input_path.string() << "` to `" << output_path.string() << '`' << std::endl;
+    job_error() << "[crails-assets] Cannot copy `" << input_path.string() << "`: " << ec.message() << std::endl;
+    return false;
   }
+  if (verbose_mode)
+    job_output() << "[crails-assets] Copied `" << input_path.string() << "` to `" << output_path.string() << '`' << std::endl;
   return true;
 }
 
-static bool generate_file(const FileMapper& filemap, const std::filesystem::path& input_path, const std::filesystem::path& output_path)
+static bool generate_text_file(const std::filesystem::path& input_path, const std::filesystem::path& output_path, const PostFilter& post_filter)
+{
+  MappedFile  input(input_path);
+  std::string output;
+
+  if (!input.is_open())
+  {
+    job_error() << "[crails-assets] Cannot read `" << input_path.string() << '`' << std::endl;
+    return false;
+  }
+  if (!post_filter(input.data(), output))
+    return false;
+  if (verbose_mode)
+    job_output() << "[crails-assets] Generated `" << input_path.string() << "` at `" << output_path.string() << '`' << std::endl;
+  return Crails::write_file("crails-assets", output_path.string(), output);
+}
+
+static bool generate_file(const FileMapper& filemap, ImageOptimizer& images, const std::filesystem::path& input_path, const std::filesystem::path& output_path)
 {
   std::string extension = input_path.extension().string();
-  PostFilter post_filter = std::bind(&inject_asset_path, filemap, std::placeholders::_1);
+  PostFilter post_filter = make_post_filter(filemap, input_path);
 
   if (extension == ".scss" || extension == ".sass")
     return generate_sass(input_path, output_path, post_filter);
   if (extension == ".js")
-    return generate_js(input_path, output_path, filemap);
+    return generate_js(input_path, output_path, filemap, post_filter);
+  if (extension == ".bundle")
+    return generate_bundle(filemap, input_path, output_path);
+  if (images.accepts(input_path))
+    return images.optimize(input_path, filemap.at(input_path.string()), output_path);
+  // Other text files only need to be rewritten when they use asset_path
+  if (may_reference_assets(input_path) && filemap.get_references(input_path.string()).size() > 0)
+    return generate_text_file(input_path, output_path, post_filter);
   return ::copy_file(input_path, output_path);
 }
 
-bool generate_public_folder(FileMapper& filemap, const std::string& output_directory, CompressionStrategy compression, bool verbose_mode)
+struct CompressionJob
+{
+  CompressionStrategy strategy;
+  JobScheduler::JobId id;
+  bool                kept = false;
+  std::size_t         size = 0;
+};
+
+struct PublicFile
+{
+  PublicFile(FileMapper::iterator source, const std::filesystem::path& output_path) : source(source), output_path(output_path)
+  {
+  }
+
+  FileMapper::iterator        source;
+  std::filesystem::path       output_path;
+  std::string                 mapped_key;
+  ImageVariant                variant; // set for the responsive variants of an image
+  JobScheduler::JobId         transform_job;
+  std::vector<CompressionJob> compression_jobs;
+  bool                        generated = false;
+  std::uintmax_t              size = 0;
+  std::string                 integrity;
+  std::unique_ptr<MappedFile> contents;
+  std::atomic<std::size_t>    pending_variants{0};
+};
+
+static bool generate_public_file(const FileMapper& filemap, ImageOptimizer& images, PublicFile& file, bool with_integrity)
+{
+  std::filesystem::path input_path(file.source->first);
+  bool is_variant = file.variant.width > 0;
+  TraceSpan span("transform", is_variant ? file.variant.filename : file.source->first);
+
+  if (verbose_mode)
+    job_output() << "[crails-assets] generating file " << input_path << " -> " << file.output_path << std::endl;
+
+  // Attempt to generate file in the public directory
+  if (is_variant ? !responsive_images.generate(input_path, file.variant, file.output_path) : !generate_file(filemap, images, input_path, file.output_path))
+  {
+    job_error() << "[crails-assets] you have an issue to fix in " << input_path.string() << std::endl;
+    return false;
+  }
+
+  // If no file has been generated, it will be removed from the FileMapper
+  file.generated = std::filesystem::exists(file.output_path);
+  if (!file.generated && verbose_mode)
+    job_output() << "[crails-assets] (!) output file was not generated, skipping" << std::endl;
+
+  // The generated file is read once, and shared by the manifest and all the compression jobs
+  else if (file.generated && (file.compression_jobs.size() > 0 || with_integrity))
+  {
+    file.contents = std::make_unique<MappedFile>(file.output_path);
+    file.size = file.contents->size();
+    if (with_integrity && file.contents->is_open())
+      file.integrity = subresource_integrity(file.contents->data());
+    file.pending_variants = file.compression_jobs.size();
+    if (file.compression_jobs.size() == 0)
+      file.contents.reset();
+  }
+  else if (file.generated)
+  {
+    std::error_code error;
+
+    file.size = std::filesystem::file_size(file.output_path, error);
+  }
+  span.arg("bytes_written", file.size);
+  return true;
+}
+
+static bool compress_public_file(PublicFile& file, CompressionJob& job, CompressionPolicy& policy)
+{
+  std::string variant_path = file.output_path.string() + compression_extension(job.strategy);
+  std::string output;
+  bool success = true;
+  TraceSpan span(compression_name(job.strategy), file.source->first);
+
+  if (!file.generated)
+    return true;
+  if (!file.contents->is_open())
+    success = false;
+  else if (!policy.should_compress(file.output_path, file.contents->size()))
+    policy.record_skipped(job.strategy);
+  else if (compress(job.strategy, file.contents->data(), output, policy.levels))
+  {
+    job.kept = policy.should_keep(file.contents->size(), output.length());
+    job.size = output.length();
+    span.arg("bytes_read", file.contents->size());
+    span.arg("bytes_written", output.length());
+    span.arg("kept", job.kept ? "yes" : "no");
+    policy.record(job.strategy, file.contents->size(), output.length(), job.kept);
+    if (job.kept)
+    {
+      if (verbose_mode)
+        job_output() << "[crails-assets] generating compressed variant " << variant_path << std::endl;
+      success = Crails::write_file("crails-assets", variant_path, output);
+    }
+    else if (verbose_mode)
+      job_output() << "[crails-assets] discarding compressed variant " << variant_path << ": " << output.length() << " bytes out of " << file.contents->size() << std::endl;
+  }
+  else
+    success = false;
+  if (!success)
+    job_error() << "[crails-assets] failed to compress " << file.output_path.string() << std::endl;
+
+  // Variants that were skipped or discarded must not be left over from a previous run
+  else if (!job.kept && std::filesystem::exists(variant_path))
+    std::filesystem::remove(variant_path);
+  if (--file.pending_variants == 0)
+    file.contents.reset();
+  return success;
+}
+
+bool generate_public_folder(FileMapper& filemap, const std::string& output_directory, CompressionPolicy& compression, ImageOptimizer& images, BuildCache& cache, AssetManifest& manifest, bool verbose_mode)
 {
   std::filesystem::path output_base(output_directory + '/' + public_scope);
+  JobScheduler scheduler(job_count);
+  std::list<PublicFile> files;
+  std::map<std::string, JobScheduler::JobId> transform_jobs, dependency_jobs;
+  std::vector<std::filesystem::path> stylesheets;
+  std::vector<SassBatch> sass_batches;
+  std::vector<JsBatch::Entry> scripts;
+  std::vector<JsBatch> js_batches;
+  bool success;
 
   if (!std::filesystem::is_directory(output_base))
   {
@@ -99,66 +274,158 @@ bool generate_public_folder(FileMapper& filemap, const std::string& output_direc
       return false;
     }
   }
-  for (auto it = filemap.begin() ; it != filemap.end() ;)
+  for (auto it = filemap.begin() ; it != filemap.end() ; ++it)
   {
-    std::filesystem::path input_path(it->first);
-    std::filesystem::path output_path(output_base.string() + filename_with_checksum(*it));
-    std::vector<CompressionStrategy> strategies = {compression};
+    std::filesystem::path output_path;
+    std::string filename, mapped_key;
 
     // If the name finishes with .map, it is a map file, and needs to be named after the file it maps
-    if (it->first.substr(it->first.length() - 4) == ".map")
+    if (!public_filename_for(filemap, it->first, filename))
     {
-      auto mapped_file = filemap.find(it->first.substr(0, it->first.length() - 4));
-      if (mapped_file == filemap.end())
-      {
-        std::cerr << "[crails-assets] could not find mapped file for " << it->first << std::endl;
-        return false;
-      }
-      output_path = output_base.string() + filename_with_checksum(*mapped_file) + ".map";
+      std::cerr << "[crails-assets] could not find mapped file for " << it->first << std::endl;
+      return false;
     }
+    if (it->first.ends_with(".map"))
+      mapped_key = it->first.substr(0, it->first.length() - 4);
+    output_path = output_base.string() + filename;
 
-    // If a file with that name already exists, then the file hasn't changed since the last run
-    if (std::filesystem::exists(output_path))
+    // If the build cache knows this output, then the file hasn't changed since the last run
+    if (cache.is_up_to_date(it->first, output_path))
     {
+      auto cached = cache.find(it->first);
+
+      if (manifest.enabled && cached != cache.end() && cached->second.output_sizes.size() == cached->second.outputs.size())
+        manifest[it->first] = {cached->second.integrity, cached->second.outputs, cached->second.output_sizes};
+      build_trace.instant("transform", it->first, "cache", "hit");
       if (verbose_mode)
         std::cout << "[crails-assets] skipping unchanged file " << output_path << std::endl;
-      ++it;
       continue ;
     }
-    else if (verbose_mode)
-      std::cout << "[crails-assets] generating file " << input_path << " -> " << output_path << std::endl;
+    files.emplace_back(it, output_path);
+    files.back().mapped_key = mapped_key;
+    if (it->first.ends_with(".scss") || it->first.ends_with(".sass"))
+      stylesheets.push_back(it->first);
+    else if (it->first.ends_with(".js"))
+      scripts.push_back({it->first, output_path});
+  }
 
-    // Attempt to generate file in the public directory
-    if (!generate_file(filemap, input_path, output_path))
+  // Variants are named after their source and settings: existing variants are up to date
+  for (auto it = filemap.begin() ; it != filemap.end() ; ++it)
+  {
+    for (const ImageVariant& variant : responsive_images.variants_for(filemap, it->first))
     {
-      std::cerr << "[crails-assets] you have an issue to fix in " << input_path.string() << std::endl;
-      return false;
+      std::filesystem::path output_path = output_base / variant.filename;
+
+      if (std::filesystem::exists(output_path))
+      {
+        if (verbose_mode)
+          std::cout << "[crails-assets] skipping unchanged variant " << output_path << std::endl;
+        continue ;
+      }
+      files.emplace_back(it, output_path);
+      files.back().variant = variant;
+    }
+  }
+
+  // Stylesheets are compiled in batches, before being generated
+  sass_batches = make_sass_batches(stylesheets, job_count);
+  for (std::size_t i = 0 ; i < sass_batches.size() ; ++i)
+  {
+    const SassBatch& batch = sass_batches[i];
+    JobScheduler::JobId batch_job = scheduler.add([&batch, i]() { return batch.compile(i); });
+
+    for (const auto& input : batch.inputs)
+      dependency_jobs.emplace(input.string(), batch_job);
+  }
+
+  // Scripts are minified in batches as well, sharing a single minifier process
+  js_batches = make_js_batches(scripts, job_count);
+  for (std::size_t i = 0 ; i < js_batches.size() ; ++i)
+  {
+    const JsBatch& batch = js_batches[i];
+    JobScheduler::JobId batch_job = scheduler.add([&batch, &filemap, i]() { return batch.compile(i, filemap); });
+
+    for (const auto& entry : batch.entries)
+      dependency_jobs.emplace(entry.input_path.string(), batch_job);
+  }
+
+  // Bundles are scheduled last, so that the jobs generating their parts already exist
+  files.sort([](const PublicFile& a, const PublicFile& b) { return !is_bundle(a.source->first) && is_bundle(b.source->first); });
+  for (PublicFile& file : files)
+  {
+    std::vector<JobScheduler::JobId> dependencies;
+
+    // Map files must wait for the file they map, which may generate its own sourcemap
+    if (transform_jobs.count(file.mapped_key))
+      dependencies.push_back(transform_jobs.at(file.mapped_key));
+    if (dependency_jobs.count(file.source->first))
+      dependencies.push_back(dependency_jobs.at(file.source->first));
+
+    // Bundles must wait for their parts, and for the sourcemaps of their parts
+    if (is_bundle(file.source->first))
+    {
+      for (const std::string& alias : filemap.get_references(file.source->first))
+      {
+        std::string key;
+
+        if (!filemap.get_key_from_alias(alias, key))
+          continue ;
+        for (const std::string& dependency : {key, key + ".map"})
+        {
+          if (transform_jobs.count(dependency))
+            dependencies.push_back(transform_jobs.at(dependency));
+        }
+      }
     }
 
-    // If no file has been generated, remove it from the FileMapper
-    if (!std::filesystem::exists(output_path))
+    // Generate the file, then each of its compressed variants
+    file.transform_job = scheduler.add([&filemap, &images, &file, &manifest]() { return generate_public_file(filemap, images, file, manifest.enabled); }, dependencies);
+    transform_jobs.emplace(file.source->first, file.transform_job);
+    file.compression_jobs.resize(compression.strategies.size());
+    for (std::size_t i = 0 ; i < compression.strategies.size() ; ++i)
     {
-      if (verbose_mode)
-        std::cout << "[crails-assets] (!) output file was not generated, skipping" << std::endl;
-      it = filemap.erase(it);
-      continue ;
+      CompressionJob& job = file.compression_jobs[i];
+
+      job.strategy = compression.strategies[i];
+      job.id = scheduler.add([&file, &job, &compression]() { return compress_public_file(file, job, compression); }, {file.transform_job});
     }
-    ++it;
+  }
+  success = scheduler.run();
+  cleanup_sass_batches();
+  cleanup_js_batches();
+  if (files.size() > 0)
+  {
+    images.print_summary(std::cout);
+    compression.print_summary(std::cout);
+  }
 
-    // Apply compression on the generated file
-    if (compression == NoCompression)
+  // Update the FileMapper and the build cache with the results
+  for (PublicFile& file : files)
+  {
+    std::vector<std::string> outputs{file.output_path.filename().string()};
+    std::vector<std::uintmax_t> output_sizes{file.size};
+
+    if (!scheduler.succeeded(file.transform_job) || file.variant.width > 0)
       continue ;
-    if (verbose_mode)
-      std::cout << "[crails-assets] generating compressed variants" << std::endl;
-    else if (compression == AllCompressions)
-      strategies = {Gzip, Brotli};
-    for (auto compression : strategies)
+    if (!file.generated)
     {
-      if (!Crails::run_command(compress_command(compression, output_path)))
-        return false;
+      filemap.erase(file.source);
+      continue ;
     }
-    if (verbose_mode)
-      std::cout << "[crails-assets] generating compressed variants done" << std::endl;
+    if (!std::all_of(file.compression_jobs.begin(), file.compression_jobs.end(), [&scheduler](const CompressionJob& job) { return scheduler.succeeded(job.id); }))
+      continue ;
+    for (const CompressionJob& job : file.compression_jobs)
+    {
+      if (job.kept)
+      {
+        outputs.push_back(outputs.front() + compression_extension(job.strategy));
+        output_sizes.push_back(job.size);
+      }
+    }
+    cache.store_outputs(file.source->first, outputs, output_sizes, file.integrity);
+    if (manifest.enabled)
+      manifest[file.source->first] = {file.integrity, outputs, output_sizes};
   }
-  return true;
+  images.cleanup(filemap);
+  return success;
 }
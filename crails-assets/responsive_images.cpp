@@ -0,0 +1,270 @@
+#include <crails/cli/process.hpp>
+#include <algorithm>
+#include <iostream>
+#include <map>
+#include "responsive_images.hpp"
+#include "file_mapper.hpp"
+#include "mapped_file.hpp"
+#include "job_scheduler.hpp"
+#include "digest.hpp"
+#include "trace.hpp"
+#include "external_tool.hpp"
+
+extern bool verbose_mode;
+extern DigestAlgorithm digest_algorithm;
+extern unsigned short checksum_length;
+extern const std::string public_scope;
+
+std::string public_path_for(const std::pair<std::string,std::string>& name_and_checksum);
+
+ResponsiveImages responsive_images;
+
+static const std::map<std::string, std::vector<std::string>> encoder_candidates{
+  {"resize", {"magick", "convert"}},
+  {"webp",   {"cwebp"}},
+  {"avif",   {"avifenc"}}
+};
+
+// The encoders are only looked up once per run
+static const std::map<std::string, ExternalTool>& encoders()
+{
+  static const std::map<std::string, ExternalTool> tools = find_external_tools(encoder_candidates);
+
+  return tools;
+}
+
+static std::string image_format(const std::filesystem::path& path)
+{
+  std::string extension = path.extension().string();
+
+  std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+  if (extension == ".png")
+    return "png";
+  if (extension == ".jpg" || extension == ".jpeg")
+    return "jpeg";
+  return "";
+}
+
+static unsigned int read_big_endian(std::string_view data, std::size_t offset, int bytes)
+{
+  unsigned int value = 0;
+
+  for (int i = 0 ; i < bytes ; ++i)
+    value = (value << 8) | static_cast<unsigned char>(data[offset + i]);
+  return value;
+}
+
+// Reads the width from the IHDR chunk of PNG images, or from the start of
+// frame segment of JPEG images.
+static bool read_image_width(const std::filesystem::path& path, unsigned int& width)
+{
+  MappedFile file(path);
+  std::string_view data = file.data();
+  std::size_t position = 2;
+
+  if (!file.is_open())
+    return false;
+  if (data.starts_with("\x89PNG\r\n\x1a\n") && data.length() >= 24)
+  {
+    width = read_big_endian(data, 16, 4);
+    return true;
+  }
+  if (!data.starts_with("\xff\xd8"))
+    return false;
+  while (position + 9 <= data.length() && static_cast<unsigned char>(data[position]) == 0xff)
+  {
+    unsigned char marker = data[position + 1];
+
+    if (marker == 0xff || (marker >= 0xd0 && marker <= 0xd9))
+    {
+      position += marker == 0xff ? 1 : 2;
+      continue ;
+    }
+    if (marker >= 0xc0 && marker <= 0xcf && marker != 0xc4 && marker != 0xc8 && marker != 0xcc)
+    {
+      width = read_big_endian(data, position + 7, 2);
+      return true;
+    }
+    position += 2 + read_big_endian(data, position + 2, 2);
+  }
+  return false;
+}
+
+static std::string extension_for(const std::filesystem::path& input_path, const std::string& format)
+{
+  if (format == image_format(input_path))
+    return input_path.extension().string();
+  return '.' + format;
+}
+
+static std::string variant_filename(const FileMapper& filemap, const std::string& key, unsigned int width, const std::string& format)
+{
+  std::filesystem::path path(key);
+  std::string encoder = encoders().at(format == "webp" || format == "avif" ? format : "resize").path;
+  std::string checksum = digest(digest_algorithm, filemap.at(key) + ':' + std::to_string(width) + ':' + format + ':' + encoder);
+
+  checksum = checksum.substr(0, checksum_length > 0 ? checksum_length : std::string::npos);
+  return path.stem().string() + '-' + std::to_string(width) + "w-" + checksum + extension_for(path, format);
+}
+
+static bool run_encoder(const std::string& command)
+{
+  if (verbose_mode)
+    job_output() << "+ " << command << std::endl;
+  return Crails::run_command(command);
+}
+
+// Drops the formats whose encoder is missing. Without ImageMagick, images
+// cannot be resized, and responsive images are disabled. Returns false for
+// unsupported formats.
+bool ResponsiveImages::configure()
+{
+  if (!is_enabled())
+    return true;
+  if (!encoders().count("resize"))
+  {
+    std::cerr << "[crails-assets] responsive images require ImageMagick (magick or convert), skipping them" << std::endl;
+    directories.clear();
+    return true;
+  }
+  for (auto it = formats.begin() ; it != formats.end() ;)
+  {
+    if (*it != "webp" && *it != "avif")
+    {
+      std::cerr << "[crails-assets] unsupported responsive image format `" << *it << '`' << std::endl;
+      return false;
+    }
+    if (!encoders().count(*it))
+    {
+      if (verbose_mode)
+        std::cout << "[crails-assets] no encoder found for " << *it << ", skipping " << *it << " variants" << std::endl;
+      it = formats.erase(it);
+    }
+    else
+      ++it;
+  }
+  for (std::string& directory : directories)
+  {
+    if (directory.length() > 0 && directory.back() != '/')
+      directory += '/';
+  }
+  std::sort(widths.begin(), widths.end());
+  widths.erase(std::unique(widths.begin(), widths.end()), widths.end());
+  return true;
+}
+
+bool ResponsiveImages::accepts(const FileMapper& filemap, const std::string& key) const
+{
+  const std::string& alias = filemap.get_alias(key);
+
+  if (image_format(key).length() == 0)
+    return false;
+  return std::any_of(directories.begin(), directories.end(), [&alias](const std::string& directory) { return alias.starts_with(directory); });
+}
+
+// Unreadable images are cached with a width of 0
+bool ResponsiveImages::source_width_for(const FileMapper& filemap, const std::string& key, unsigned int& width) const
+{
+  const std::string& fingerprint = filemap.at(key);
+  auto it = source_widths.find(key);
+
+  if (it == source_widths.end() || it->second.first != fingerprint)
+  {
+    width = 0;
+    read_image_width(key, width);
+    source_widths[key] = {fingerprint, width};
+  }
+  else
+    width = it->second.second;
+  return width > 0;
+}
+
+// The modern formats also get a variant at the width of the source image
+std::vector<ImageVariant> ResponsiveImages::variants_for(const FileMapper& filemap, const std::string& key) const
+{
+  std::vector<ImageVariant> variants;
+  std::vector<std::string> variant_formats{image_format(key)};
+  unsigned int source_width;
+
+  if (!is_enabled() || !accepts(filemap, key) || !source_width_for(filemap, key, source_width))
+    return variants;
+  variant_formats.insert(variant_formats.end(), formats.begin(), formats.end());
+  for (const std::string& format : variant_formats)
+  {
+    for (unsigned int width : widths)
+    {
+      if (width < source_width)
+        variants.push_back({variant_filename(filemap, key, width, format), width, format});
+    }
+    if (format != variant_formats.front())
+      variants.push_back({variant_filename(filemap, key, source_width, format), source_width, format});
+  }
+  return variants;
+}
+
+// AVIF variants are resized with ImageMagick first, as avifenc cannot resize.
+// Variants are encoded to a temporary file first: an interrupted encoder must
+// not leave a partial variant, which would be considered up to date.
+bool ResponsiveImages::generate(const std::filesystem::path& input_path, const ImageVariant& variant, const std::filesystem::path& output_path) const
+{
+  std::filesystem::path temporary_path = output_path.string() + ".tmp" + output_path.extension().string();
+  std::map<std::string, std::string> variables{
+    {"input", input_path.string()},
+    {"output", temporary_path.string()},
+    {"width", std::to_string(variant.width)}
+  };
+  std::string resize = '"' + encoders().at("resize").path + "\" \"$input\" -resize $widthx \"$output\"";
+  std::filesystem::path resized_path = output_path.string() + ".resized" + input_path.extension().string();
+  std::error_code ec;
+  bool success;
+  TraceSpan span("variant", output_path.filename().string(), true);
+
+  if (variant.format == "webp")
+    success = run_encoder(replace_variables('"' + encoders().at("webp").path + "\" -quiet -resize $width 0 \"$input\" -o \"$output\"", variables));
+  else if (variant.format == "avif")
+  {
+    variables["output"] = resized_path.string();
+    success = run_encoder(replace_variables(resize, variables));
+    success = success && run_encoder('"' + encoders().at("avif").path + "\" \"" + resized_path.string() + "\" \"" + temporary_path.string() + "\" > /dev/null");
+    std::filesystem::remove(resized_path, ec);
+  }
+  else
+    success = run_encoder(replace_variables(resize, variables));
+  if (success)
+  {
+    std::filesystem::rename(temporary_path, output_path, ec);
+    success = !ec;
+  }
+  if (!success)
+  {
+    job_error() << "[crails-assets] could not generate the " << variant.width << "w " << variant.format << " variant of " << input_path.string() << std::endl;
+    std::filesystem::remove(temporary_path, ec);
+  }
+  else if (verbose_mode)
+    job_output() << "[crails-assets] Generated `" << output_path.string() << "` from `" << input_path.string() << '`' << std::endl;
+  return success;
+}
+
+// The srcset of the source format also lists the source image itself
+std::vector<std::pair<std::string, std::string>> ResponsiveImages::srcsets(const FileMapper& filemap, const std::string& key) const
+{
+  std::vector<std::pair<std::string, std::string>> result;
+  std::vector<ImageVariant> variants = variants_for(filemap, key);
+  std::string source_format = image_format(key);
+  std::map<std::string, std::string> values;
+  unsigned int source_width;
+
+  if (variants.empty() || !source_width_for(filemap, key, source_width))
+    return result;
+  for (const ImageVariant& variant : variants)
+  {
+    std::string& srcset = values[variant.format];
+
+    srcset += (srcset.length() > 0 ? ", /" : "/") + public_scope + variant.filename + ' ' + std::to_string(variant.width) + 'w';
+  }
+  values[source_format] += (values[source_format].length() > 0 ? ", " : "") + public_path_for({key, filemap.at(key)}) + ' ' + std::to_string(source_width) + 'w';
+  result.emplace_back("srcset", values[source_format]);
+  for (const std::string& format : formats)
+    result.emplace_back(format + "_srcset", values[format]);
+  return result;
+}
@@ -0,0 +1,49 @@
+#pragma once
+#include <filesystem>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+struct FileMapper;
+
+struct ImageVariant
+{
+  std::string  filename;
+  unsigned int width = 0;
+  std::string  format; // png, jpeg, webp or avif
+};
+
+// Generates resized variants of the PNG and JPEG images whose alias starts
+// with one of `directories`, along with WebP and AVIF variants when their
+// encoder is installed. Resizing relies on ImageMagick.
+//
+// Variants are named after the fingerprint of their source image, their
+// width, format and encoder: their public paths are known without
+// generating them, and a variant which already exists is up to date.
+// Images are never upscaled: widths larger than the source are skipped.
+class ResponsiveImages
+{
+public:
+  std::vector<std::string>  directories;
+  std::vector<unsigned int> widths{480, 960, 1920};
+  std::vector<std::string>  formats{"webp", "avif"};
+
+  bool                      is_enabled() const { return directories.size() > 0; }
+  bool                      configure();
+  bool                      accepts(const FileMapper& filemap, const std::string& key) const;
+  std::vector<ImageVariant> variants_for(const FileMapper& filemap, const std::string& key) const;
+  bool                      generate(const std::filesystem::path& input_path, const ImageVariant& variant, const std::filesystem::path& output_path) const;
+
+  // Pairs of constant suffix (srcset, webp_srcset, avif_srcset) and srcset values
+  std::vector<std::pair<std::string, std::string>> srcsets(const FileMapper& filemap, const std::string& key) const;
+
+private:
+  bool source_width_for(const FileMapper& filemap, const std::string& key, unsigned int& width) const;
+
+  // Widths of the source images, along with the fingerprint they were read
+  // for, so that each version of an image only gets read once
+  mutable std::unordered_map<std::string, std::pair<std::string, unsigned int>> source_widths;
+};
+
+extern ResponsiveImages responsive_images;
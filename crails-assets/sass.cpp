@@ -1,13 +1,26 @@
 #include <iostream>
 #include <string_view>
-#include <regex>
 #include <filesystem>
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <unistd.h>
 #include <crails/cli/filesystem.hpp>
 #include <crails/cli/process.hpp>
+#include <crails/read_file.hpp>
+#include "sass.hpp"
+#include "job_scheduler.hpp"
+#include "trace.hpp"
+#include "external_tool.hpp"
+#ifdef CRAILS_ASSETS_WITH_LIBSASS
+# include <sass/context.h>
+#endif
 
 extern bool with_source_maps;
+extern bool verbose_mode;
 
 static const std::vector<std::string> sass_candidates{"scss", "sass", "node-sass"};
+static const std::vector<std::string> batch_sass_candidates{"sass"};
 static const std::map<std::string, std::string> sass_options{
   {"scss",      "--style compressed"},
   {"sass",      "--style compressed"},
@@ -20,56 +33,202 @@ static const std::map<std::string, std::string> sass_sourcemap_options{
   {"node-sass", "--source-map-embed"}
 };
 
+// dart-sass writes sourcemaps by default when compiling to files (batches)
+static const std::map<std::string, std::string> sass_no_sourcemap_options{
+  {"sass",      "--no-source-map"}
+};
+
+static std::mutex                                         batch_mutex;
+static std::map<std::filesystem::path, std::filesystem::path> batch_outputs;
+static std::filesystem::path                              batch_directory;
+
 static std::pair<std::string, std::string> find_sass()
 {
-  for (const std::string& candidate : sass_candidates)
-  {
-    std::string result = Crails::which(candidate);
+#ifdef CRAILS_ASSETS_WITH_LIBSASS
+  return {"libsass", std::string("libsass ") + libsass_version()};
+#else
+  ExternalTool tool = find_external_tool(sass_candidates);
 
-    if (result.length() > 0)
-      return {candidate, result};
-  }
-  return {"", ""};
+  return {tool.name, tool.path};
+#endif
 }
 
-static std::string sass_command(const std::pair<std::string, std::string>& sass_impl, const std::filesystem::path& input)
+// The sass implementation is only looked up once per run
+static const std::pair<std::string, std::string>& get_sass()
+{
+  static const std::pair<std::string, std::string> sass_impl = find_sass();
+
+  return sass_impl;
+}
+
+std::string sass_implementation()
+{
+  return get_sass().second;
+}
+
+static std::string sass_command(const std::pair<std::string, std::string>& sass_impl)
 {
   std::stringstream stream;
 
-  stream << sass_impl.second << ' ' << sass_options.at(sass_impl.first) << ' ';
+  stream << sass_impl.second << ' ' << sass_options.at(sass_impl.first);
   if (with_source_maps)
-    stream << sass_sourcemap_options.at(sass_impl.first) << ' ';
-  stream << input.string();
+    stream << ' ' << sass_sourcemap_options.at(sass_impl.first);
+  else if (sass_no_sourcemap_options.count(sass_impl.first))
+    stream << ' ' << sass_no_sourcemap_options.at(sass_impl.first);
   return stream.str();
 }
 
-bool generate_sass(const std::filesystem::path& input_path, const std::filesystem::path& output_path, std::function<std::string(const std::string&)> post_filter)
+static bool is_partial(const std::filesystem::path& input_path)
+{
+  return input_path.filename().string()[0] == '_';
+}
+
+std::vector<SassBatch> make_sass_batches(const std::vector<std::filesystem::path>& inputs, unsigned int batch_count)
+{
+  std::vector<SassBatch> batches;
+  std::vector<std::filesystem::path> stylesheets;
+  const std::string& implementation = get_sass().first;
+
+  if (std::find(batch_sass_candidates.begin(), batch_sass_candidates.end(), implementation) == batch_sass_candidates.end())
+    return batches;
+  std::copy_if(inputs.begin(), inputs.end(), std::back_inserter(stylesheets), [](const std::filesystem::path& input) { return !is_partial(input); });
+  batches.resize(std::min<std::size_t>(std::max(1u, batch_count), stylesheets.size()));
+  for (std::size_t i = 0 ; i < stylesheets.size() ; ++i)
+    batches[i % batches.size()].inputs.push_back(stylesheets[i]);
+  if (batches.size() > 0)
+  {
+    std::string directory_template = (std::filesystem::temp_directory_path() / "crails-assets-sass-XXXXXX").string();
+
+    if (mkdtemp(directory_template.data()))
+      batch_directory = directory_template;
+    else
+      batches.clear();
+  }
+  return batches;
+}
+
+void cleanup_sass_batches()
+{
+  std::error_code error;
+
+  if (batch_directory.string().length() > 0)
+    std::filesystem::remove_all(batch_directory, error);
+  batch_directory.clear();
+  batch_outputs.clear();
+}
+
+bool SassBatch::compile(unsigned int index) const
+{
+  std::stringstream command;
+  std::vector<std::filesystem::path> outputs;
+  std::string errors;
+
+  command << sass_command(get_sass());
+  for (std::size_t i = 0 ; i < inputs.size() ; ++i)
+  {
+    outputs.push_back(batch_directory / (std::to_string(index) + '-' + std::to_string(i) + ".css"));
+    command << ' ' << inputs[i].string() << ':' << outputs.back().string();
+  }
+  // Compiled stylesheets are written to files: the output only holds the errors
+  command << " 2>&1";
+  if (verbose_mode)
+    job_output() << "[crails-assets] sass batch command: " << command.str() << std::endl;
+  // Even when the batch fails, the stylesheets that did compile can be used
+  {
+    TraceSpan span("sass", "batch " + std::to_string(index), true);
+
+    span.arg("inputs", inputs.size());
+    Crails::run_command(command.str(), errors);
+  }
+  if (errors.length() > 0)
+    job_error() << errors << (errors.back() == '\n' ? "" : "\n");
+  for (std::size_t i = 0 ; i < inputs.size() ; ++i)
+  {
+    if (std::filesystem::exists(outputs[i]))
+    {
+      std::lock_guard<std::mutex> lock(batch_mutex);
+      batch_outputs.emplace(inputs[i], outputs[i]);
+    }
+  }
+  return true;
+}
+
+static bool fetch_batch_output(const std::filesystem::path& input_path, std::string& output)
 {
-  auto sass_impl = find_sass();
+  std::filesystem::path batch_output;
 
-  if (input_path.filename().string()[0] == '_')
+  {
+    std::lock_guard<std::mutex> lock(batch_mutex);
+    auto it = batch_outputs.find(input_path);
+
+    if (it == batch_outputs.end())
+      return false;
+    batch_output = it->second;
+  }
+  return Crails::read_file(batch_output.string(), output);
+}
+
+#ifdef CRAILS_ASSETS_WITH_LIBSASS
+static bool compile_with_libsass(const std::filesystem::path& input_path, std::string& output)
+{
+  struct Sass_File_Context* file_context = sass_make_file_context(input_path.c_str());
+  struct Sass_Context*      context = sass_file_context_get_context(file_context);
+  struct Sass_Options*      options = sass_context_get_options(context);
+  bool                      success;
+
+  sass_option_set_output_style(options, SASS_STYLE_COMPRESSED);
+  if (with_source_maps)
+  {
+    sass_option_set_source_map_embed(options, true);
+    sass_option_set_source_map_contents(options, true);
+    sass_option_set_source_map_file(options, (input_path.string() + ".map").c_str());
+  }
+  success = sass_compile_file_context(file_context) == 0;
+  if (success)
+    output = sass_context_get_output_string(context);
+  else
+    job_error() << sass_context_get_error_message(context);
+  sass_delete_file_context(file_context);
+  return success;
+}
+#endif
+
+static bool compile_sass(const std::pair<std::string, std::string>& sass_impl, const std::filesystem::path& input_path, std::string& output)
+{
+#ifdef CRAILS_ASSETS_WITH_LIBSASS
+  return compile_with_libsass(input_path, output);
+#else
+  std::string cmd = sass_command(sass_impl) + ' ' + input_path.string();
+  TraceSpan span("sass", input_path.string(), true);
+
+  job_output() << "[crails-assets] sass command: " << cmd << std::endl;
+  return Crails::run_command(cmd, output);
+#endif
+}
+
+bool generate_sass(const std::filesystem::path& input_path, const std::filesystem::path& output_path, const PostFilter& post_filter)
+{
+  const auto& sass_impl = get_sass();
+
+  if (is_partial(input_path))
     return true;
   if (sass_impl.first.length() > 0)
   {
     std::string output, injected_source;
-    std::string cmd = sass_command(sass_impl, input_path);
 
-    std::cout << "[crails-assets] sass command: " << cmd << std::endl;
-    if (!Crails::run_command(cmd, output))
+    if (!fetch_batch_output(input_path, output) && !compile_sass(sass_impl, input_path, output))
       return false;
-    injected_source = post_filter(output);
-    if (injected_source.length() == 0)
+    if (!post_filter(output, injected_source))
       return false;
     Crails::write_file("crails-assets", output_path.string(), injected_source);
-    std::cout << "[crails-sass] generated css for `" << input_path.string() << "` at `" << output_path.string() << '`' << std::endl;
+    job_output() << "[crails-sass] generated css for `" << input_path.string() << "` at `" << output_path.string() << '`' << std::endl;
     return true;
   }
   else
   {
-    std::cerr << "Cannot convert `" << input_path.string() << "` to css. Sass not found." << std::endl;
-    std::cerr << "Looked for:" << std::endl;
-    for (const std::string& candidate : sass_candidates) std::cerr << "- " << candidate << std::endl;
+    job_error() << "Cannot convert `" << input_path.string() << "` to css. Sass not found." << std::endl;
+    job_error() << "Looked for:" << std::endl;
+    for (const std::string& candidate : sass_candidates) job_error() << "- " << candidate << std::endl;
   }
   return false;
 }
-
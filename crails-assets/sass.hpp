@@ -0,0 +1,21 @@
+#pragma once
+#include <filesystem>
+#include <string>
+#include <vector>
+#include "asset_path_scanner.hpp"
+
+// Compiles several stylesheets with a single sass process. Batches are
+// compiled ahead of generate_sass, which then picks up the compiled css.
+// Stylesheets that a batch failed to compile are compiled individually by
+// generate_sass, which reports their errors.
+struct SassBatch
+{
+  std::vector<std::filesystem::path> inputs;
+
+  bool compile(unsigned int index) const;
+};
+
+std::string            sass_implementation();
+std::vector<SassBatch> make_sass_batches(const std::vector<std::filesystem::path>& inputs, unsigned int batch_count);
+void                   cleanup_sass_batches();
+bool                   generate_sass(const std::filesystem::path& input_path, const std::filesystem::path& output_path, const PostFilter& post_filter);
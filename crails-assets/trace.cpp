@@ -0,0 +1,169 @@
+#include "trace.hpp"
+#include "json.hpp"
+#include <crails/cli/filesystem.hpp>
+#include <sys/resource.h>
+#include <algorithm>
+#include <iomanip>
+#include <sstream>
+
+BuildTrace build_trace;
+
+static long long children_cpu_time()
+{
+  struct rusage usage;
+
+  if (getrusage(RUSAGE_CHILDREN, &usage) != 0)
+    return 0;
+  return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000ll + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+long long BuildTrace::now() const
+{
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - origin).count();
+}
+
+unsigned int BuildTrace::current_thread()
+{
+  std::lock_guard<std::mutex> lock(mutex);
+
+  return threads.emplace(std::this_thread::get_id(), threads.size()).first->second;
+}
+
+void BuildTrace::add(Event event)
+{
+  std::lock_guard<std::mutex> lock(mutex);
+
+  events.push_back(std::move(event));
+}
+
+// Starts the trace of a new build, in watch mode. It must be called from the
+// main thread, while no jobs are running.
+void BuildTrace::reset()
+{
+  std::lock_guard<std::mutex> lock(mutex);
+
+  origin = std::chrono::steady_clock::now();
+  events.clear();
+  threads.clear();
+  threads.emplace(std::this_thread::get_id(), 0);
+}
+
+void BuildTrace::instant(std::string_view stage, std::string_view name, std::string_view key, std::string_view value)
+{
+  Event event;
+
+  if (!is_enabled())
+    return ;
+  event.stage = stage;
+  event.name = name;
+  event.phase = 'i';
+  event.thread = current_thread();
+  event.start = now();
+  event.args.emplace_back(key, json_string(value));
+  add(std::move(event));
+}
+
+bool BuildTrace::save() const
+{
+  std::stringstream stream;
+
+  if (!is_enabled())
+    return true;
+  stream << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [" << std::endl;
+  stream << "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 0, \"args\": {\"name\": \"crails-assets\"}}";
+  for (const auto& thread : threads)
+  {
+    stream << ',' << std::endl << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << thread.second
+           << ", \"args\": {\"name\": \"" << (thread.second == 0 ? "main" : "worker " + std::to_string(thread.second)) << "\"}}";
+  }
+  for (const Event& event : events)
+  {
+    stream << ',' << std::endl
+           << "{\"name\": " << json_string(event.name) << ", \"cat\": " << json_string(event.stage)
+           << ", \"ph\": \"" << event.phase << "\", \"pid\": 1, \"tid\": " << event.thread << ", \"ts\": " << event.start;
+    if (event.phase == 'X')
+      stream << ", \"dur\": " << event.duration;
+    else
+      stream << ", \"s\": \"t\"";
+    stream << ", \"args\": {";
+    for (std::size_t i = 0 ; i < event.args.size() ; ++i)
+      stream << (i > 0 ? ", " : "") << json_string(event.args[i].first) << ": " << event.args[i].second;
+    stream << "}}";
+  }
+  stream << std::endl << "]}" << std::endl;
+  return Crails::write_file("crails-assets", output_path.string(), stream.str());
+}
+
+void BuildTrace::print_summary(std::ostream& stream, std::size_t count) const
+{
+  struct StageSummary { std::size_t count = 0; long long total = 0, longest = 0; };
+  std::map<std::string, StageSummary> stages;
+  std::vector<const Event*> slowest;
+
+  for (const Event& event : events)
+  {
+    StageSummary& summary = stages[event.stage];
+
+    if (event.phase != 'X')
+      continue ;
+    summary.count++;
+    summary.total += event.duration;
+    summary.longest = std::max(summary.longest, event.duration);
+    if (event.stage != "phase")
+      slowest.push_back(&event);
+  }
+  std::sort(slowest.begin(), slowest.end(), [](const Event* a, const Event* b) { return a->duration > b->duration; });
+  slowest.resize(std::min(count, slowest.size()));
+  stream << std::fixed << std::setprecision(1);
+  stream << "[crails-assets] " << std::left << std::setw(16) << "stage" << std::right
+         << std::setw(8) << "count" << std::setw(12) << "total ms" << std::setw(12) << "max ms" << std::endl;
+  for (const auto& stage : stages)
+  {
+    if (stage.second.count == 0)
+      continue ;
+    stream << "[crails-assets] " << std::left << std::setw(16) << stage.first << std::right
+           << std::setw(8) << stage.second.count
+           << std::setw(12) << stage.second.total / 1000.0
+           << std::setw(12) << stage.second.longest / 1000.0 << std::endl;
+  }
+  if (slowest.size() > 0)
+    stream << "[crails-assets] slowest steps:" << std::endl;
+  for (const Event* event : slowest)
+    stream << "[crails-assets] " << std::setw(10) << event->duration / 1000.0 << " ms  " << std::left << std::setw(10) << event->stage << std::right << ' ' << event->name << std::endl;
+}
+
+TraceSpan::TraceSpan(std::string_view stage, std::string_view name, bool subprocess) : active(build_trace.is_enabled()), subprocess(subprocess)
+{
+  if (active)
+  {
+    event.stage = stage;
+    event.name = name;
+    event.thread = build_trace.current_thread();
+    event.start = build_trace.now();
+    if (subprocess)
+      children_cpu = children_cpu_time();
+  }
+}
+
+TraceSpan::~TraceSpan()
+{
+  if (active)
+  {
+    event.duration = build_trace.now() - event.start;
+    if (subprocess)
+      arg("child_cpu_us", static_cast<std::uintmax_t>(std::max(0ll, children_cpu_time() - children_cpu)));
+    build_trace.add(std::move(event));
+  }
+}
+
+void TraceSpan::arg(std::string_view key, std::string_view value)
+{
+  if (active)
+    event.args.emplace_back(key, json_string(value));
+}
+
+void TraceSpan::arg(std::string_view key, std::uintmax_t value)
+{
+  if (active)
+    event.args.emplace_back(key, std::to_string(value));
+}
@@ -0,0 +1,69 @@
+#pragma once
+#include <filesystem>
+#include <chrono>
+#include <mutex>
+#include <map>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+// Collects the events of a build, written with --trace in the Chrome trace
+// event format (which Perfetto and chrome://tracing can open). Events are
+// grouped by stage (checksum, transform, sass, minify, gzip...), and named
+// after the asset or phase they cover.
+class BuildTrace
+{
+public:
+  struct Event
+  {
+    std::string name;
+    std::string stage;
+    char        phase = 'X'; // X: complete event, i: instant event
+    unsigned int thread = 0;
+    long long   start = 0;    // microseconds
+    long long   duration = 0; // microseconds
+    std::vector<std::pair<std::string, std::string>> args; // values are JSON literals
+  };
+
+  BuildTrace() : origin(std::chrono::steady_clock::now()) {}
+
+  void         enable(const std::filesystem::path& path) { output_path = path; }
+  bool         is_enabled() const { return output_path.string().length() > 0; }
+  long long    now() const;
+  unsigned int current_thread();
+  void         add(Event event);
+  void         reset();
+  void         instant(std::string_view stage, std::string_view name, std::string_view key, std::string_view value);
+  bool         save() const;
+  void         print_summary(std::ostream& stream, std::size_t count = 10) const;
+
+private:
+  std::filesystem::path                 output_path;
+  std::chrono::steady_clock::time_point origin;
+  std::mutex                            mutex;
+  std::vector<Event>                    events;
+  std::map<std::thread::id, unsigned int> threads;
+};
+
+extern BuildTrace build_trace;
+
+// Records a complete event from its construction to its destruction. Spans
+// covering subprocesses also record the CPU time of the children reaped in
+// the meantime: with parallel jobs, it may include other jobs' children.
+class TraceSpan
+{
+public:
+  TraceSpan(std::string_view stage, std::string_view name, bool subprocess = false);
+  ~TraceSpan();
+
+  void arg(std::string_view key, std::string_view value);
+  void arg(std::string_view key, std::uintmax_t value);
+
+private:
+  bool              active;
+  bool              subprocess;
+  long long         children_cpu = 0;
+  BuildTrace::Event event;
+};
@@ -0,0 +1,217 @@
+#include <sys/inotify.h>
+#include <poll.h>
+#include <unistd.h>
+#include <filesystem>
+#include <unordered_map>
+#include <chrono>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include "watch.hpp"
+#include "file_mapper.hpp"
+#include "glob_pattern.hpp"
+
+extern bool verbose_mode;
+
+// Events are only handled once the input folders have been quiet for this
+// long, so that editors saving several files at once trigger a single build.
+static const int watch_debounce_ms = 100;
+static const uint32_t watch_events = IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF;
+
+class AssetWatcher
+{
+public:
+  AssetWatcher(FileMapper& files, const std::vector<WatchedDirectory>& roots, const PathFilter& filter)
+    : files(files), roots(roots), filter(filter)
+  {
+    fd = inotify_init1(IN_CLOEXEC);
+  }
+
+  ~AssetWatcher()
+  {
+    if (fd >= 0)
+      close(fd);
+  }
+
+  bool start()
+  {
+    if (fd < 0)
+    {
+      std::cerr << "[crails-assets] cannot initialize inotify" << std::endl;
+      return false;
+    }
+    for (std::size_t i = 0 ; i < roots.size() ; ++i)
+    {
+      if (std::filesystem::is_directory(roots[i].directory))
+        watch_directory(roots[i].directory, i, false);
+    }
+    return true;
+  }
+
+  // Blocks until some changes were applied to the FileMapper
+  bool wait_for_changes()
+  {
+    changes = 0;
+    while (changes == 0)
+    {
+      if (!read_events(-1))
+        return false;
+      while (poll_events(watch_debounce_ms))
+      {
+        if (!read_events(0))
+          return false;
+      }
+    }
+    return true;
+  }
+
+  unsigned int change_count() const { return changes; }
+
+private:
+  struct Watch
+  {
+    std::filesystem::path directory;
+    std::size_t           root;
+  };
+
+  bool poll_events(int timeout)
+  {
+    struct pollfd descriptor{fd, POLLIN, 0};
+
+    return poll(&descriptor, 1, timeout) > 0;
+  }
+
+  bool read_events(int timeout)
+  {
+    alignas(struct inotify_event) char buffer[16384];
+    ssize_t length;
+
+    if (timeout < 0 && !poll_events(timeout))
+      return false;
+    length = read(fd, buffer, sizeof(buffer));
+    if (length <= 0)
+      return false;
+    for (char* it = buffer ; it < buffer + length ; it += sizeof(struct inotify_event) + reinterpret_cast<struct inotify_event*>(it)->len)
+      handle_event(*reinterpret_cast<struct inotify_event*>(it));
+    return true;
+  }
+
+  void watch_directory(const std::filesystem::path& directory, std::size_t root, bool collect)
+  {
+    std::error_code error;
+    int wd = inotify_add_watch(fd, directory.c_str(), watch_events);
+
+    if (wd < 0)
+    {
+      std::cerr << "[crails-assets] cannot watch " << directory << std::endl;
+      return ;
+    }
+    watches[wd] = Watch{directory, root};
+    for (const auto& entry : std::filesystem::directory_iterator(directory, error))
+    {
+      std::filesystem::path relative_path = entry.path().lexically_relative(roots[root].directory);
+
+      if (entry.is_directory(error) && !entry.is_symlink(error))
+      {
+        if (!filter.is_excluded_directory(relative_path))
+          watch_directory(entry.path(), root, collect);
+      }
+      else if (collect)
+        add_file(entry.path(), root);
+    }
+  }
+
+  void add_file(const std::filesystem::path& path, std::size_t root)
+  {
+    std::error_code error;
+
+    if (!std::filesystem::is_regular_file(path, error) || !filter.accepts_file(path.lexically_relative(roots[root].directory)))
+      return ;
+    if (files.find(path.string()) == files.end())
+    {
+      if (verbose_mode)
+        std::cout << "[crails-assets] added " << path.string() << std::endl;
+      files.collect_file(roots[root].directory, path, roots[root].scope);
+    }
+    else
+      files.invalidate(path.string());
+    changes++;
+  }
+
+  void remove_file(FileMapper::iterator it)
+  {
+    if (verbose_mode)
+      std::cout << "[crails-assets] removed " << it->first << std::endl;
+    files.erase(it);
+    changes++;
+  }
+
+  // Removes a file, or every file of a removed directory
+  void remove_files(const std::filesystem::path& path)
+  {
+    std::string prefix = path.string() + '/';
+    auto it = files.find(path.string());
+
+    if (it != files.end())
+      remove_file(it);
+    for (it = files.lower_bound(prefix) ; it != files.end() && it->first.starts_with(prefix) ; it = files.lower_bound(prefix))
+      remove_file(it);
+  }
+
+  void handle_event(const struct inotify_event& event)
+  {
+    auto watch = watches.find(event.wd);
+    std::filesystem::path path;
+
+    if (watch == watches.end())
+      return ;
+    if (event.mask & IN_IGNORED)
+    {
+      watches.erase(watch);
+      return ;
+    }
+    if (event.len == 0)
+      return ;
+    path = watch->second.directory / event.name;
+    if (event.mask & (IN_DELETE | IN_MOVED_FROM))
+      remove_files(path);
+    else if (event.mask & IN_ISDIR)
+    {
+      if (!filter.is_excluded_directory(path.lexically_relative(roots[watch->second.root].directory)))
+        watch_directory(path, watch->second.root, true);
+    }
+    else if (event.mask & (IN_CLOSE_WRITE | IN_MOVED_TO))
+      add_file(path, watch->second.root);
+  }
+
+  FileMapper&                          files;
+  const std::vector<WatchedDirectory>& roots;
+  const PathFilter&                    filter;
+  std::unordered_map<int, Watch>       watches;
+  unsigned int                         changes = 0;
+  int                                  fd;
+};
+
+// The FileMapper stays in memory between builds: on each change, only the
+// modified assets are hashed again, and only the assets whose fingerprint
+// changed (the modified assets and the assets referencing them) are
+// generated again.
+int watch_assets(FileMapper& files, const std::vector<WatchedDirectory>& roots, const PathFilter& filter, std::function<bool()> build)
+{
+  AssetWatcher watcher(files, roots, filter);
+
+  if (!watcher.start())
+    return -1;
+  std::cout << "[crails-assets] watching for changes" << std::endl;
+  while (watcher.wait_for_changes())
+  {
+    auto start = std::chrono::steady_clock::now();
+    bool success = build();
+    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+
+    std::cout << "[crails-assets] " << (success ? "rebuilt" : "failed to rebuild") << " after "
+              << watcher.change_count() << " changes (" << duration.count() << "ms)" << std::endl;
+  }
+  std::cerr << "[crails-assets] stopped watching: " << std::strerror(errno) << std::endl;
+  return -1;
+}
@@ -0,0 +1,16 @@
+#pragma once
+#include <filesystem>
+#include <functional>
+#include <string>
+#include <vector>
+
+struct FileMapper;
+class PathFilter;
+
+struct WatchedDirectory
+{
+  std::filesystem::path directory;
+  std::string           scope;
+};
+
+int watch_assets(FileMapper& files, const std::vector<WatchedDirectory>& roots, const PathFilter& filter, std::function<bool()> build);
@@ -0,0 +1,19 @@
+#pragma once
+#include <ctime>
+#include <string>
+#include <vector>
+#include "embed_mode.hpp"
+
+struct BuiltinAssetsOptions
+{
+  std::string              classname;
+  std::string              uri_root;
+  std::string              compression;
+  std::vector<std::string> encodings;
+  EmbedMode                embed_mode = StringLiteralEmbed;
+  bool                     register_assets = true;
+  unsigned int             job_count = 1;
+  std::size_t              shard_size = 0;       // bytes per shard, or 0 when not sharding
+  bool                     shard_per_asset = false;
+  std::time_t              last_modified = -1;   // Last-Modified date of every asset, or -1 for their modification time
+};
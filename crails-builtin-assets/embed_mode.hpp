@@ -0,0 +1,17 @@
+#pragma once
+#include <string>
+
+// How the asset bytes are stored in the generated source:
+// - string literals, supported by every compiler;
+// - C23 #embed directives, which require GCC 15 or Clang 19;
+// - assembler .incbin directives, for ELF targets.
+// The last two modes store the assets in separate files, next to the
+// generated source, and let the compiler or the assembler load them.
+enum EmbedMode
+{
+  StringLiteralEmbed,
+  PreprocessorEmbed,
+  AssemblerEmbed
+};
+
+bool get_embed_mode(const std::string& name, EmbedMode& mode);
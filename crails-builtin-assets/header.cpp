@@ -1,26 +1,52 @@
 #include <map>
 #include <string>
-#include <fstream>
+#include <sstream>
 #include <iostream>
+#include <crails/cli/filesystem.hpp>
+#include <crails/read_file.hpp>
 
 std::string filepath_to_varname(const std::string& filepath);
 
 void generate_header(const std::string& path, const std::string& classname, const std::map<std::string, std::string>& files)
 {
-  std::ofstream header;
+  std::stringstream header;
+  std::string current;
 
-  header.open(path + ".hpp");
   header << "#pragma once" << std::endl;
   header << "#include <crails/request_handlers/builtin_assets.hpp>" << std::endl;
+  header << "#include <cstdint>" << std::endl;
+  header << "#include <string_view>" << std::endl;
   header << std::endl;
   header << "// Generated by crails-builtin-assets" << std::endl;
   header << "class " << classname << " : public Crails::BuiltinAssets" << std::endl;
   header << '{' << std::endl;
   header << "public:" << std::endl;
+  header << "  struct Encoding" << std::endl;
+  header << "  {" << std::endl;
+  header << "    std::string_view name; // Content-Encoding" << std::endl;
+  header << "    const void*      data;" << std::endl;
+  header << "    unsigned int     length; // Content-Length" << std::endl;
+  header << "    std::string_view etag;" << std::endl;
+  header << "  };" << std::endl;
+  header << std::endl;
+  header << "  struct Asset" << std::endl;
+  header << "  {" << std::endl;
+  header << "    std::string_view path;" << std::endl;
+  header << "    std::string_view content_type;" << std::endl;
+  header << "    std::string_view last_modified;" << std::endl;
+  header << "    const Encoding*  encodings; // smallest first" << std::endl;
+  header << "    unsigned int     encoding_count;" << std::endl;
+  header << "  };" << std::endl;
+  header << std::endl;
   header << "  " << classname << "();" << std::endl;
   header << std::endl;
+  header << "  // Finds an asset by its path relative to the uri root" << std::endl;
+  header << "  static const Asset* find(std::string_view path);" << std::endl;
+  header << std::endl;
   for (const auto& file : files)
     header << "  static const char* " << filepath_to_varname(file.second) << ';' << std::endl;
   header << "};" << std::endl;
-  header.close();
+  // The header is included by application code: it is only written when it changed
+  if (!Crails::read_file(path + ".hpp", current) || current != header.str())
+    Crails::write_file("crails-builtin-assets", path + ".hpp", header.str());
 }
@@ -1,21 +1,86 @@
 #include "file_mapper.hpp"
+#include "compression.hpp"
+#include "builtin_options.hpp"
 #include <boost/program_options.hpp>
+#include <algorithm>
+#include <cstdlib>
 #include <fstream>
+#include <thread>
 #include <iostream>
 
 void generate_header(const std::string& path, const std::string& classname, const std::map<std::string, std::string>& files);
-void generate_source(const std::string& path, const std::string& classname, const std::string& compression_strategy, const std::string& uri_root, const std::map<std::string, std::string>& files);
+bool generate_source(const std::string& path, const BuiltinAssetsOptions& options, const std::map<std::string, std::string>& files);
 
-std::map<std::string,std::string> compression_strategies{
-  {"gzip","gz"},{"brotli","br"}
+std::map<std::string, CompressionStrategy> compression_strategies{
+  {"gzip", Gzip},{"brotli", Brotli}
 };
 
-std::string tmp_path("/tmp/crails-builtin-asset");
+static bool are_valid_encodings(const std::vector<std::string>& encodings)
+{
+  for (const std::string& name : encodings)
+  {
+    if (name != "identity" && compression_strategies.find(name) == compression_strategies.end())
+      return false;
+  }
+  return true;
+}
+
+// Repeated encodings are only embedded once
+static std::vector<std::string> unique_encodings(const std::vector<std::string>& encodings)
+{
+  std::vector<std::string> result;
+
+  for (const std::string& name : encodings)
+  {
+    if (std::find(result.begin(), result.end(), name) == result.end())
+      result.push_back(name);
+  }
+  return result;
+}
+
+// SOURCE_DATE_EPOCH replaces the modification times of the assets, which
+// differ between checkouts, for reproducible builds.
+static bool get_source_date_epoch(BuiltinAssetsOptions& options)
+{
+  const char* value = std::getenv("SOURCE_DATE_EPOCH");
+  std::size_t length = 0;
+
+  if (!value)
+    return true;
+  try
+  {
+    options.last_modified = std::stoll(value, &length);
+  }
+  catch (const std::exception&)
+  {
+    return false;
+  }
+  return length == std::string_view(value).length() && options.last_modified >= 0;
+}
+
+static bool get_shard_option(const std::string& value, BuiltinAssetsOptions& options)
+{
+  if (value == "asset")
+    options.shard_per_asset = true;
+  else
+  {
+    try
+    {
+      options.shard_size = std::stoull(value);
+    }
+    catch (const std::exception&)
+    {
+      return false;
+    }
+  }
+  return options.shard_per_asset || options.shard_size > 0;
+}
 
 int main(int argc, const char** argv)
 {
   boost::program_options::options_description desc("Options");
   boost::program_options::variables_map options;
+  BuiltinAssetsOptions builtin_options;
 
   desc.add_options()
     ("inputs,i", boost::program_options::value<std::vector<std::string>>()->multitoken(), "list of inputs folders")
@@ -23,6 +88,11 @@ int main(int argc, const char** argv)
     ("classname,c", boost::program_options::value<std::string>(), "classname for the builtin asset library")
     ("compression,z", boost::program_options::value<std::string>(), "compression strategy (gzip or brotli)")
     ("uri-root,u", boost::program_options::value<std::string>(), "uri root")
+    ("encodings", boost::program_options::value<std::vector<std::string>>()->multitoken(), "encodings embedded for each asset, among identity, gzip and brotli; compressed encodings are only kept when smaller than the original file (defaults to the compression strategy)")
+    ("embed,e", boost::program_options::value<std::string>(), "how assets are embedded: string (string literals, default), embed (C23 #embed) or incbin (assembler .incbin)")
+    ("shard", boost::program_options::value<std::string>(), "split the generated source in one file per asset (asset), or per given number of bytes, in <output>.shards")
+    ("jobs,j", boost::program_options::value<unsigned int>(), "number of parallel jobs (defaults to the number of cores)")
+    ("no-register", "do not register the assets with BuiltinAssets::add in the constructor, for handlers relying on the generated find() lookup")
     ("help,h", "display this help message");
   boost::program_options::store(boost::program_options::parse_command_line(argc, argv, desc), options);
   boost::program_options::notify(options);
@@ -35,19 +105,32 @@ int main(int argc, const char** argv)
     std::cout << "invalid compression strategies (supported values are gzip or brotli)" << std::endl;
   else if (!options.count("uri-root"))
     std::cout << "missing uri-root" << std::endl;
+  else if (options.count("embed") && !get_embed_mode(options["embed"].as<std::string>(), builtin_options.embed_mode))
+    std::cout << "invalid embed mode (supported values are string, embed or incbin)" << std::endl;
+  else if (options.count("encodings") && !are_valid_encodings(options["encodings"].as<std::vector<std::string>>()))
+    std::cout << "invalid encodings (supported values are identity, gzip or brotli)" << std::endl;
+  else if (options.count("shard") && !get_shard_option(options["shard"].as<std::string>(), builtin_options))
+    std::cout << "invalid shard option (supported values are asset, or a number of bytes)" << std::endl;
+  else if (!get_source_date_epoch(builtin_options))
+    std::cout << "invalid SOURCE_DATE_EPOCH (expected a number of seconds since the epoch)" << std::endl;
   else if (options.count("inputs") && options.count("output"))
   {
     FileMapper files;
     auto output = options["output"].as<std::string>();
-    auto classname = options["classname"].as<std::string>();
-    auto compression = options["compression"].as<std::string>();
-    auto uri_root = options["uri-root"].as<std::string>();
 
+    builtin_options.classname = options["classname"].as<std::string>();
+    builtin_options.compression = options["compression"].as<std::string>();
+    builtin_options.uri_root = options["uri-root"].as<std::string>();
+    builtin_options.register_assets = !options.count("no-register");
+    builtin_options.job_count = options.count("jobs") ? options["jobs"].as<unsigned int>() : std::thread::hardware_concurrency();
+    if (options.count("encodings"))
+      builtin_options.encodings = unique_encodings(options["encodings"].as<std::vector<std::string>>());
+    else
+      builtin_options.encodings.push_back(builtin_options.compression);
     for (const std::string& path : options["inputs"].as<std::vector<std::string>>())
       files.collect_files(path);
-    generate_header(output, classname, files);
-    generate_source(output, classname, compression, uri_root, files);
-    return 0;
+    generate_header(output, builtin_options.classname, files);
+    return generate_source(output, builtin_options, files) ? 0 : -1;
   }
   else
     std::cerr << "invalid options" << std::endl;
@@ -0,0 +1,129 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Hash functions shared by the generator and the generated lookup tables:
+// keys are hashed once with FNV-1a, then the hash gets mixed with a seed by
+// the murmur3 finalizer, which spreads every bit of the hash in the result.
+// The generated sources embed a copy of these functions (see
+// perfect_hash_source): both must be kept in sync.
+constexpr std::uint64_t builtin_asset_hash(std::string_view key)
+{
+  std::uint64_t hash = 14695981039346656037ull;
+
+  for (char c : key)
+  {
+    hash ^= static_cast<unsigned char>(c);
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+constexpr std::uint64_t builtin_asset_mix(std::uint64_t hash, std::uint64_t seed)
+{
+  hash ^= seed * 0x9e3779b97f4a7c15ull;
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdull;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+inline const char* perfect_hash_source =
+  "constexpr std::uint64_t builtin_asset_hash(std::string_view key)\n"
+  "{\n"
+  "  std::uint64_t hash = 14695981039346656037ull;\n"
+  "\n"
+  "  for (char c : key)\n"
+  "  {\n"
+  "    hash ^= static_cast<unsigned char>(c);\n"
+  "    hash *= 1099511628211ull;\n"
+  "  }\n"
+  "  return hash;\n"
+  "}\n"
+  "\n"
+  "constexpr std::uint64_t builtin_asset_mix(std::uint64_t hash, std::uint64_t seed)\n"
+  "{\n"
+  "  hash ^= seed * 0x9e3779b97f4a7c15ull;\n"
+  "  hash ^= hash >> 33;\n"
+  "  hash *= 0xff51afd7ed558ccdull;\n"
+  "  hash ^= hash >> 33;\n"
+  "  return hash;\n"
+  "}\n";
+
+// Minimal perfect hash, built with the hash and displace method: keys are
+// first spread in buckets of about four keys, then each bucket gets a seed
+// placing all of its keys in free slots of the table. A lookup hashes the
+// key once, then mixes the hash to find its bucket seed, and its slot:
+//
+//   hash = builtin_asset_hash(key)
+//   slot = mix(hash, seeds[mix(hash, 0) % seeds.size()]) % slots.size()
+//
+// The key stored in the slot must still be compared with the looked up key,
+// since unknown keys also land on some slot.
+struct PerfectHash
+{
+  static constexpr std::size_t no_key = static_cast<std::size_t>(-1);
+
+  std::vector<std::uint64_t> seeds;
+  std::vector<std::size_t>   slots; // index of the key stored in each slot
+
+  bool build(const std::vector<std::string>& keys, std::uint64_t max_seed = 1 << 24)
+  {
+    std::vector<std::vector<std::size_t>> buckets(std::max<std::size_t>(1, (keys.size() + 3) / 4));
+    std::vector<std::size_t> order(buckets.size());
+    std::vector<std::size_t> positions;
+    std::vector<std::uint64_t> hashes(keys.size());
+
+    seeds.assign(buckets.size(), 0);
+    slots.assign(keys.size(), no_key);
+    for (std::size_t i = 0 ; i < keys.size() ; ++i)
+    {
+      hashes[i] = builtin_asset_hash(keys[i]);
+      buckets[builtin_asset_mix(hashes[i], 0) % buckets.size()].push_back(i);
+    }
+    for (std::size_t i = 0 ; i < order.size() ; ++i)
+      order[i] = i;
+    // Larger buckets are placed first, while the table still has many free slots
+    std::stable_sort(order.begin(), order.end(), [&buckets](std::size_t a, std::size_t b)
+    {
+      return buckets[a].size() > buckets[b].size();
+    });
+    for (std::size_t bucket : order)
+    {
+      std::uint64_t seed = 1;
+
+      if (buckets[bucket].size() == 0)
+        break ;
+      for (; seed < max_seed ; ++seed)
+      {
+        positions.clear();
+        for (std::size_t key : buckets[bucket])
+        {
+          std::size_t position = builtin_asset_mix(hashes[key], seed) % slots.size();
+
+          if (slots[position] != no_key || std::find(positions.begin(), positions.end(), position) != positions.end())
+            break ;
+          positions.push_back(position);
+        }
+        if (positions.size() == buckets[bucket].size())
+          break ;
+      }
+      if (seed == max_seed)
+        return false;
+      seeds[bucket] = seed;
+      for (std::size_t i = 0 ; i < positions.size() ; ++i)
+        slots[positions[i]] = buckets[bucket][i];
+    }
+    return true;
+  }
+
+  std::size_t slot_for(std::string_view key) const
+  {
+    std::uint64_t hash = builtin_asset_hash(key);
+
+    return builtin_asset_mix(hash, seeds[builtin_asset_mix(hash, 0) % seeds.size()]) % slots.size();
+  }
+};
@@ -1,119 +1,507 @@
 #include <string>
+#include <string_view>
 #include <map>
 #include <fstream>
-#include <cstdlib>
 #include <iostream>
-#include <crails/cli/process.hpp>
+#include <filesystem>
+#include <algorithm>
+#include <ctime>
+#include <sstream>
+#include <functional>
+#include <thread>
+#include <atomic>
+#include <sys/stat.h>
+#include <crails/cli/filesystem.hpp>
 #include <crails/utils/split.hpp>
 #include <crails/read_file.hpp>
-//#include <boost/process.hpp>
-#include <chrono>
+#include "compression.hpp"
+#include "builtin_options.hpp"
+#include "digest.hpp"
+#include "mime_type.hpp"
+#include "perfect_hash.hpp"
 
 std::string filepath_to_varname(const std::string& filepath);
 
-extern std::map<std::string,std::string> compression_strategies;
-extern std::string tmp_path;
-std::string xxd_tmp_path = "/tmp/xxd_output";
+extern std::map<std::string, CompressionStrategy> compression_strategies;
 
 using namespace std;
-using namespace std::chrono_literals;
 
-static string replace_all(std::string str, const std::string& from, const std::string& to)
+struct EmbeddedEncoding
 {
-  size_t start_pos = 0;
-  while((start_pos = str.find(from, start_pos)) != std::string::npos)
+  std::string name; // Content-Encoding value
+  std::string varname;
+  std::string data;
+  std::string etag;
+  bool        embedded = true;
+};
+
+struct EmbeddedAsset
+{
+  std::string                   path;
+  std::string                   varname;
+  std::string                   content_type;
+  std::string                   last_modified;
+  std::vector<EmbeddedEncoding> blobs;
+  std::vector<std::size_t>      encodings; // indexes of the served blobs, smallest first
+};
+
+static const std::map<std::string, std::string> content_encodings{
+  {"identity", "identity"},
+  {"gzip",     "gzip"},
+  {"brotli",   "br"}
+};
+
+static const std::map<std::string, EmbedMode> embed_modes{
+  {"string", StringLiteralEmbed},
+  {"embed",  PreprocessorEmbed},
+  {"incbin", AssemblerEmbed}
+};
+
+bool get_embed_mode(const std::string& name, EmbedMode& mode)
+{
+  auto it = embed_modes.find(name);
+
+  if (it != embed_modes.end())
+  {
+    mode = it->second;
+    return true;
+  }
+  return false;
+}
+
+// Writes the bytes as concatenated string literals, split every few kilobytes
+// to keep the lines short. Printable characters are written as they are, and
+// other bytes as three-digit octal escapes, which cannot swallow the next
+// character the way hexadecimal escapes do.
+static void write_string_literal(std::ostream& stream, std::string_view data)
+{
+  static const std::size_t line_length = 4096;
+  std::string literal;
+
+  literal.reserve(data.length() * 2 + data.length() / line_length * 6 + 2);
+  literal += '"';
+  for (std::size_t i = 0 ; i < data.length() ; ++i)
+  {
+    unsigned char c = data[i];
+
+    if (i > 0 && i % line_length == 0)
+      literal += "\"\n  \"";
+    if (c == '"' || c == '\\' || c == '?')
+    {
+      literal += '\\';
+      literal += c;
+    }
+    else if (c >= 0x20 && c < 0x7f)
+      literal += c;
+    else
+    {
+      literal += '\\';
+      literal += static_cast<char>('0' + (c >> 6));
+      literal += static_cast<char>('0' + ((c >> 3) & 7));
+      literal += static_cast<char>('0' + (c & 7));
+    }
+  }
+  literal += '"';
+  stream.write(literal.data(), literal.length());
+}
+
+// Writes the definition of a blob. Blobs defined in shards are shared with
+// the main source, and are named after the class to avoid clashes.
+static void write_blob_definition(std::ostream& source, const std::string& classname, const EmbeddedEncoding& blob, const std::string& embed_path, EmbedMode mode, bool shared)
+{
+  std::string symbol = classname + '_' + blob.varname;
+  std::string declaration = shared ? "extern constexpr " : "static constexpr ";
+  std::string name = shared ? symbol : blob.varname;
+
+  switch (mode)
+  {
+  case StringLiteralEmbed:
+    source << declaration << "char " << name << "[] =\n  ";
+    write_string_literal(source, blob.data);
+    source << ";\n";
+    break ;
+  case PreprocessorEmbed:
+    source << declaration << "unsigned char " << name << "[] = {\n"
+           << "#embed \"" << embed_path << "\"\n"
+           << "};\n";
+    break ;
+  case AssemblerEmbed:
+    source << "asm(\".pushsection .rodata\\n\"\n"
+           << "    \".globl " << symbol << "\\n\"\n"
+           << "    \".globl " << symbol << "_end\\n\"\n"
+           << "    \".balign 16\\n\"\n"
+           << "    \"" << symbol << ":\\n\"\n"
+           << "    \".incbin \\\"" << embed_path << "\\\"\\n\"\n"
+           << "    \"" << symbol << "_end:\\n\"\n"
+           << "    \".popsection\\n\");\n";
+    break ;
+  }
+}
+
+// Writes what the main source needs to use a blob: a pointer to blobs defined
+// elsewhere, and the blob length.
+static void write_blob_reference(std::ostream& source, const std::string& classname, const EmbeddedEncoding& blob, EmbedMode mode, bool shared)
+{
+  std::string symbol = classname + '_' + blob.varname;
+
+  if (mode == AssemblerEmbed)
+  {
+    source << "extern \"C\" const char " << symbol << "[];\n"
+           << "extern \"C\" const char " << symbol << "_end[];\n"
+           << "static constexpr const char* " << blob.varname << " = " << symbol << ";\n";
+  }
+  else if (shared)
+  {
+    std::string type = mode == PreprocessorEmbed ? "unsigned char" : "char";
+
+    source << "extern const " << type << ' ' << symbol << "[];\n"
+           << "static constexpr const " << type << "* " << blob.varname << " = " << symbol << ";\n";
+  }
+  source << "static constexpr unsigned int " << blob.varname << "_len = " << blob.data.length() << ";\n";
+}
+
+static std::string http_date(std::time_t time)
+{
+  char buffer[64];
+  std::tm date;
+
+  gmtime_r(&time, &date);
+  std::strftime(buffer, sizeof(buffer), "%a, %d %b %Y %H:%M:%S GMT", &date);
+  return buffer;
+}
+
+static std::string blob_varname(const std::string& varname, const std::string& encoding, const BuiltinAssetsOptions& options)
+{
+  // The blob registered with BuiltinAssets::add keeps the name it always had
+  if (encoding == options.compression)
+    return varname;
+  return varname + '_' + encoding;
+}
+
+// Reads and encodes an asset. Compressed encodings are only served when they
+// are smaller than the original file, unless none of the requested encodings
+// qualifies, in which case the smallest one is served. The blob compressed
+// with the default compression strategy is always embedded when assets are
+// registered with BuiltinAssets::add.
+static bool prepare_asset(const std::pair<std::string, std::string>& file, const BuiltinAssetsOptions& options, EmbeddedAsset& asset)
+{
+  std::string contents, fingerprint;
+  std::vector<std::string> blob_names = options.encodings;
+  struct stat info;
+
+  if (!Crails::read_file(file.first, contents) || ::stat(file.first.c_str(), &info) != 0)
+  {
+    std::cerr << "cannot read " << file.first << std::endl;
+    return false;
+  }
+  asset.path = file.second;
+  asset.varname = filepath_to_varname(file.second);
+  asset.content_type = mime_type_for(file.first);
+  asset.last_modified = http_date(options.last_modified >= 0 ? options.last_modified : info.st_mtime);
+  fingerprint = digest(Xxh64Digest, contents);
+  if (options.register_assets && std::find(blob_names.begin(), blob_names.end(), options.compression) == blob_names.end())
+    blob_names.push_back(options.compression);
+  for (const std::string& name : blob_names)
+  {
+    EmbeddedEncoding blob;
+
+    blob.name = content_encodings.at(name);
+    blob.varname = blob_varname(asset.varname, name, options);
+    blob.etag = fingerprint + (name == "identity" ? std::string() : '-' + blob.name);
+    if (name == "identity")
+      blob.data = contents;
+    else if (!compress(compression_strategies.at(name), contents, blob.data, CompressionLevels()))
+    {
+      std::cerr << "cannot compress " << file.first << std::endl;
+      return false;
+    }
+    asset.blobs.push_back(std::move(blob));
+  }
+  for (std::size_t i = 0 ; i < options.encodings.size() ; ++i)
+  {
+    if (asset.blobs[i].name == "identity" || asset.blobs[i].data.length() < contents.length())
+      asset.encodings.push_back(i);
+  }
+  if (asset.encodings.size() == 0 && options.encodings.size() > 0)
+  {
+    asset.encodings.push_back(0);
+    for (std::size_t i = 1 ; i < options.encodings.size() ; ++i)
+    {
+      if (asset.blobs[i].data.length() < asset.blobs[asset.encodings.front()].data.length())
+        asset.encodings.front() = i;
+    }
+  }
+  std::sort(asset.encodings.begin(), asset.encodings.end(), [&asset](std::size_t a, std::size_t b)
+  {
+    return asset.blobs[a].data.length() < asset.blobs[b].data.length();
+  });
+  // Blobs which are neither served nor registered are not embedded
+  for (std::size_t i = 0 ; i < asset.blobs.size() ; ++i)
+  {
+    bool served = std::find(asset.encodings.begin(), asset.encodings.end(), i) != asset.encodings.end();
+    bool registered = options.register_assets && asset.blobs[i].varname == asset.varname;
+
+    asset.blobs[i].embedded = served || registered;
+  }
+  return true;
+}
+
+static std::filesystem::path blob_path_for(const std::filesystem::path& blob_directory, const EmbeddedEncoding& blob)
+{
+  return blob_directory / (blob.varname + '.' + blob.name);
+}
+
+// Paths are relative to the source file, which keeps generated sources
+// independent from where they were generated. #embed looks them up from the
+// directory of the source file, and .incbin from the include directories of
+// the assembler (see write_embed_check).
+static std::string embed_path_for(const std::filesystem::path& blob_directory, const EmbeddedEncoding& blob, bool shared)
+{
+  std::filesystem::path blob_path = blob_path_for(blob_directory, blob);
+
+  return (shared ? "../" : "") + blob_directory.filename().string() + '/' + blob_path.filename().string();
+}
+
+static void write_embedded_asset(std::ostream& source, const std::filesystem::path& blob_directory, const BuiltinAssetsOptions& options, const EmbeddedAsset& asset, bool sharded)
+{
+  source << "const char* " << options.classname << "::" << asset.varname << " = \""
+         << options.uri_root << asset.path << "\";\n";
+  for (const EmbeddedEncoding& blob : asset.blobs)
+  {
+    if (!blob.embedded)
+      continue ;
+    if (!sharded)
+      write_blob_definition(source, options.classname, blob, embed_path_for(blob_directory, blob, false), options.embed_mode, false);
+    write_blob_reference(source, options.classname, blob, options.embed_mode, sharded);
+  }
+  source << "static constexpr " << options.classname << "::Encoding " << asset.varname << "_encodings[] = {\n";
+  for (std::size_t index : asset.encodings)
+  {
+    const EmbeddedEncoding& blob = asset.blobs[index];
+
+    source << "  {\"" << blob.name << "\", " << blob.varname << ", " << blob.varname << "_len, \"\\\"" << blob.etag << "\\\"\"},\n";
+  }
+  source << "};\n\n";
+}
+
+static void write_embed_check(std::ostream& source, EmbedMode mode)
+{
+  if (mode == PreprocessorEmbed)
+    source << "#ifndef __has_embed\n"
+           << "# error \"assets were generated for #embed, which this compiler does not support\"\n"
+           << "#endif\n\n";
+  else if (mode == AssemblerEmbed)
+    source << "// The .incbin paths are relative to this file: compile it with its directory\n"
+           << "// in the include directories of the assembler (-Wa,-I<directory>)\n\n";
+}
+
+static std::string render_shard(const std::filesystem::path& blob_directory, const BuiltinAssetsOptions& options, const std::vector<EmbeddedAsset>& assets, const std::vector<std::size_t>& indexes)
+{
+  std::stringstream source;
+
+  source << "// Generated by crails-builtin-assets\n\n";
+  write_embed_check(source, options.embed_mode);
+  for (std::size_t index : indexes)
+  {
+    for (const EmbeddedEncoding& blob : assets[index].blobs)
+    {
+      if (blob.embedded)
+        write_blob_definition(source, options.classname, blob, embed_path_for(blob_directory, blob, true), options.embed_mode, true);
+    }
+  }
+  return source.str();
+}
+
+// Shards are either made of a single asset, named after it, or of as many
+// consecutive assets as fit in the shard size.
+static std::map<std::string, std::vector<std::size_t>> plan_shards(const BuiltinAssetsOptions& options, const std::vector<EmbeddedAsset>& assets)
+{
+  std::map<std::string, std::vector<std::size_t>> shards;
+  std::size_t shard_bytes = 0, shard_index = 0;
+
+  for (std::size_t i = 0 ; i < assets.size() ; ++i)
   {
-    str.replace(start_pos, from.length(), to);
-    start_pos += to.length();
+    std::size_t asset_bytes = 0;
+
+    for (const EmbeddedEncoding& blob : assets[i].blobs)
+      asset_bytes += blob.embedded ? blob.data.length() : 0;
+    if (options.shard_per_asset)
+    {
+      shards[assets[i].varname].push_back(i);
+      continue ;
+    }
+    if (shard_bytes > 0 && shard_bytes + asset_bytes > options.shard_size)
+    {
+      shard_index++;
+      shard_bytes = 0;
+    }
+    shards["shard" + std::to_string(shard_index)].push_back(i);
+    shard_bytes += asset_bytes;
   }
-  return str;
+  return shards;
+}
+
+static void parallel_for(std::size_t count, unsigned int job_count, const std::function<void(std::size_t)>& callback)
+{
+  std::atomic<std::size_t> next_index{0};
+  std::vector<std::thread> threads;
+  auto worker = [&]()
+  {
+    for (std::size_t index = next_index++ ; index < count ; index = next_index++)
+      callback(index);
+  };
+
+  for (unsigned int i = 1 ; i < std::min<std::size_t>(std::max(1u, job_count), count) ; ++i)
+    threads.emplace_back(worker);
+  worker();
+  for (auto& thread : threads)
+    thread.join();
+}
+
+// Generated files are only written when their contents changed, so that the
+// build system only recompiles the shards that did change.
+static bool write_if_changed(const std::filesystem::path& path, const std::string& contents)
+{
+  std::string current;
+
+  if (std::filesystem::exists(path) && Crails::read_file(path.string(), current) && current == contents)
+    return true;
+  return Crails::write_file("crails-builtin-assets", path.string(), contents);
 }
 
-static void compress_asset(const std::string& strategy, const std::string& filepath)
+// Writes the lookup table of the assets, indexed by a perfect hash of their
+// path relative to the uri root, so that find() only ever probes one slot.
+static bool write_lookup_table(std::ostream& source, const std::string& classname, const std::vector<EmbeddedAsset>& assets)
 {
-  std::string command = strategy + " -kc " + filepath;
-  std::string result;
+  std::vector<std::string> keys;
+  PerfectHash hash;
+
+  for (const EmbeddedAsset& asset : assets)
+    keys.push_back(asset.path);
+  if (!hash.build(keys))
+  {
+    std::cerr << "cannot build a perfect hash for the asset paths" << std::endl;
+    return false;
+  }
+  // Without assets, find has no table to look up: zero-size arrays are invalid
+  if (keys.size() == 0)
+  {
+    source << "const " << classname << "::Asset* " << classname << "::find(std::string_view)\n"
+           << "{\n"
+           << "  return nullptr;\n";
+    source << "}\n\n";
+    return true;
+  }
+  source << "namespace\n{\n" << perfect_hash_source << '\n'
+         << "constexpr std::uint64_t seeds[] = {";
+  for (std::size_t i = 0 ; i < hash.seeds.size() ; ++i)
+    source << (i % 8 == 0 ? "\n  " : " ") << hash.seeds[i] << "ull,";
+  source << "\n};\n\n"
+         << "constexpr " << classname << "::Asset assets[] = {\n";
+  for (std::size_t key : hash.slots)
+  {
+    const EmbeddedAsset& asset = assets[key];
 
-  std::cout << "+ " << command << std::endl;
-  std::system((command + " > " + tmp_path).c_str());
+    source << "  {\"" << asset.path << "\", \"" << asset.content_type << "\", \"" << asset.last_modified << "\", "
+           << asset.varname << "_encodings, " << asset.encodings.size() << "},\n";
+  }
+  source << "};\n}\n\n"
+         << "const " << classname << "::Asset* " << classname << "::find(std::string_view path)\n"
+         << "{\n"
+         << "  std::uint64_t hash = builtin_asset_hash(path);\n"
+         << "  const Asset& asset = assets[builtin_asset_mix(hash, seeds[builtin_asset_mix(hash, 0) % " << hash.seeds.size() << "]) % " << keys.size() << "];\n"
+         << '\n'
+         << "  return asset.path == path ? &asset : nullptr;\n";
+  source << "}\n\n";
+  return true;
 }
 
-void generate_source(const std::string& path, const std::string& classname, const std::string& compression_strategy, const std::string& uri_root, const std::map<std::string, std::string>& files)
+bool generate_source(const std::string& path, const BuiltinAssetsOptions& options, const std::map<std::string, std::string>& files)
 {
   std::string header_path = *Crails::split(path, '/').rbegin() + ".hpp";
-  std::string source_path = path + ".cpp";
+  std::filesystem::path blob_directory = path + ".assets";
+  std::filesystem::path shard_directory = path + ".shards";
+  std::vector<std::pair<std::string, std::string>> inputs(files.begin(), files.end());
+  std::vector<EmbeddedAsset> assets(files.size());
+  std::vector<char> prepared(files.size(), false);
+  std::map<std::string, std::vector<std::size_t>> shards;
+  std::vector<std::pair<std::filesystem::path, std::string>> outputs;
+  bool sharded = options.shard_per_asset || options.shard_size > 0;
+  std::stringstream source;
+
+  if (options.embed_mode != StringLiteralEmbed)
+    std::filesystem::create_directories(blob_directory);
+  // Encode the files in parallel, and store the blobs loaded by #embed or .incbin
+  parallel_for(inputs.size(), options.job_count, [&](std::size_t i)
+  {
+    prepared[i] = prepare_asset(inputs[i], options, assets[i]);
+    for (const EmbeddedEncoding& blob : assets[i].blobs)
+    {
+      if (prepared[i] && blob.embedded && options.embed_mode != StringLiteralEmbed)
+        prepared[i] = write_if_changed(blob_path_for(blob_directory, blob), blob.data);
+    }
+  });
+  for (std::size_t i = 0 ; i < inputs.size() ; ++i)
   {
-    std::ofstream source;
-    source.open(source_path);
-    source << "#include \"" << header_path << "\"" << std::endl << std::endl;
-    source.close();
+    if (!prepared[i])
+      return false;
+    std::cout << "+ " << inputs[i].first << " (" << assets[i].content_type << ", " << assets[i].encodings.size() << " encodings)" << std::endl;
   }
-  // Use xxd to append the files as binary in the C++ file
-  for (const auto& file : files)
+
+  // Shards only hold the blobs, while the main source refers to them
+  if (sharded)
   {
-    std::string command, output;
-    std::ofstream source;
-
-    source.open(source_path, std::ios_base::app);
-    source << "const char* " << classname << "::" << filepath_to_varname(file.second) << " = \""
-           << uri_root << file.second << "\";" << std::endl
-           << "static const ";
-    compress_asset(compression_strategy, file.first);
-    // Older versions of xxd don't support the option -n
-    //command = "xxd -n " + filepath_to_varname(file.second) + " -i " + tmp_path;
-    // PATCH for older versions of xxd
-    command = "xxd -i " + tmp_path;
-    // END PATCH for older versions of xxd
-    std::cout << "+ " << command << std::endl;
-
-    // the boost::process systematically truncates the output for some files,
-    // so we're working around it by using std::system and shell redirections
-    // instead, then calling Crails::read_file.
-    std::system((command + " > " + xxd_tmp_path).c_str());
-    Crails::read_file(xxd_tmp_path, output);
-
-    // PATCH for older versions of xxd
-    filepath_to_varname(tmp_path);
-    output = replace_all(output, filepath_to_varname(tmp_path), filepath_to_varname(file.second));
-    // END PATCH for older versions of xxd
-
-    source << output;
-    source.close();
-  }
-  // Makes the length variables static and const
-  {
-    std::string command, output;
-   
-    command =  std::string("awk ")
-      + '\''
-      + "{ if ($0 ~ /^unsigned/) { gsub(\"unsigned\", \"static const unsigned\"); print $0 } else { print $0 } }"
-      + '\''
-      + ' ' + source_path
-      + " > /tmp/tmpfile";
-    std::cout << command << std::endl;
-    std::system(command.c_str());
-    Crails::read_file("/tmp/tmpfile", output);
+    shards = plan_shards(options, assets);
+    outputs.resize(shards.size());
     {
-      std::ofstream source;
-      source.open(source_path);
-      source << output;
-      source.close();
+      auto shard = shards.begin();
+
+      for (std::size_t i = 0 ; i < outputs.size() ; ++i, ++shard)
+        outputs[i].first = shard_directory / (shard->first + ".cpp");
     }
+    parallel_for(outputs.size(), options.job_count, [&](std::size_t i)
+    {
+      outputs[i].second = render_shard(blob_directory, options, assets, shards.at(outputs[i].first.stem().string()));
+    });
   }
+  source << "#include \"" << header_path << "\"\n\n";
+  if (!sharded)
+    write_embed_check(source, options.embed_mode);
+  for (const EmbeddedAsset& asset : assets)
+    write_embedded_asset(source, blob_directory, options, asset, sharded);
+  if (!write_lookup_table(source, options.classname, assets))
+    return false;
   // Append the constructor for BuiltinAssets
+  source << options.classname << "::" << options.classname << "() : Crails::BuiltinAssets(\""
+         << options.uri_root << "\", "
+         << '"' << options.compression << "\")" << std::endl;
+  source << '{' << std::endl;
+  for (const auto& file : files)
+  {
+    if (!options.register_assets)
+      break ;
+    source << "  add(\"" << file.second << "\", "
+           << "reinterpret_cast<const char*>(::" << filepath_to_varname(file.second) << "), "
+           << filepath_to_varname(file.second) << "_len);" << std::endl;
+  }
+  source << '}' << std::endl;
+  outputs.emplace_back(path + ".cpp", source.str());
+
+  // Remove the shards left over by previous runs
+  if (std::filesystem::is_directory(shard_directory))
   {
-    std::ofstream source;
-    source.open(source_path, std::ios_base::app);
-    source << classname << "::" << classname << "() : Crails::BuiltinAssets(\""
-           << uri_root << "\", "
-           << '"' << compression_strategy << "\")" << std::endl;
-    source << '{' << std::endl;
-    for (const auto& file : files)
+    for (const auto& entry : std::filesystem::directory_iterator(shard_directory))
     {
-      source << "  add(\"" << file.second << "\", "
-             << "reinterpret_cast<const char*>(::" << filepath_to_varname(file.second) << "), "
-             << filepath_to_varname(file.second) << "_len);" << std::endl;
+      if (entry.path().extension() == ".cpp" && (!sharded || !shards.count(entry.path().stem().string())))
+        std::filesystem::remove(entry.path());
     }
-    source << '}' << std::endl;
   }
+  if (sharded)
+    std::filesystem::create_directories(shard_directory);
+  for (const auto& output : outputs)
+  {
+    if (!write_if_changed(output.first, output.second))
+      return false;
+  }
+  return true;
 }